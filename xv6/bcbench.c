@@ -0,0 +1,151 @@
+// Buffer cache benchmark: runs fixed mixes of file reads,
+// writes and metadata operations and reports, for each, the
+// buffer cache hit ratio from /dev/bcstat and the elapsed time.
+//
+// usage: bcbench [blocks [rounds]]
+
+#include "param.h"
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+#include "fcntl.h"
+#include "bcstat.h"
+
+#define NMETA 20  // files each metadata round creates
+
+char data[BSIZE];
+struct bcstat st[NCPU];
+int nblocks = 100;
+int rounds = 4;
+
+struct total {
+  uint hit, miss, evict, wait, nearmiss;
+};
+
+// Sum the counters of all CPUs into t.
+void
+counters(struct total *t)
+{
+  int fd, i, n;
+
+  memset(t, 0, sizeof(*t));
+  if((fd = open("/dev/bcstat", O_RDONLY)) < 0){
+    printf(2, "bcbench: cannot open /dev/bcstat\n");
+    exit();
+  }
+  n = read(fd, st, sizeof(st));
+  close(fd);
+  for(i = 0; i < n / sizeof(st[0]); i++){
+    t->hit += st[i].hit;
+    t->miss += st[i].miss;
+    t->evict += st[i].evcold + st[i].evhot;
+    t->wait += st[i].wait;
+    t->nearmiss += st[i].nearmiss;
+  }
+}
+
+void
+writefile(void)
+{
+  int fd, i;
+
+  if((fd = open("bcbench.f", O_CREATE|O_RDWR)) < 0){
+    printf(2, "bcbench: cannot create bcbench.f\n");
+    exit();
+  }
+  for(i = 0; i < nblocks; i++)
+    if(write(fd, data, sizeof(data)) != sizeof(data)){
+      printf(2, "bcbench: write failed\n");
+      exit();
+    }
+  close(fd);
+}
+
+void
+readfile(void)
+{
+  int fd;
+
+  if((fd = open("bcbench.f", O_RDONLY)) < 0){
+    printf(2, "bcbench: cannot open bcbench.f\n");
+    exit();
+  }
+  while(read(fd, data, sizeof(data)) > 0)
+    ;
+  close(fd);
+}
+
+void
+metadata(void)
+{
+  char name[] = "bcm00";
+  struct stat s;
+  int fd, i;
+
+  for(i = 0; i < NMETA; i++){
+    name[3] = '0' + i/10;
+    name[4] = '0' + i%10;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf(2, "bcbench: cannot create %s\n", name);
+      exit();
+    }
+    close(fd);
+  }
+  for(i = 0; i < NMETA; i++){
+    name[3] = '0' + i/10;
+    name[4] = '0' + i%10;
+    stat(name, &s);
+  }
+  for(i = 0; i < NMETA; i++){
+    name[3] = '0' + i/10;
+    name[4] = '0' + i%10;
+    unlink(name);
+  }
+}
+
+// Run f rounds times and report what the cache did.
+// kb is the data f moves each round, if any.
+void
+phase(char *name, void (*f)(void), int kb)
+{
+  struct total a, b;
+  uint hit, miss, t;
+  int i;
+
+  counters(&a);
+  t = uptime();
+  for(i = 0; i < rounds; i++)
+    f();
+  t = uptime() - t;
+  counters(&b);
+
+  hit = b.hit - a.hit;
+  miss = b.miss - a.miss;
+  printf(1, "%s: %d hits %d misses (%d%%) %d evictions %d waits %d near misses, %d ticks",
+         name, hit, miss, hit + miss ? 100*hit/(hit + miss) : 0,
+         b.evict - a.evict, b.wait - a.wait, b.nearmiss - a.nearmiss, t);
+  if(kb && t)  // about 100 ticks a second
+    printf(1, ", %d KB/s", kb*rounds*100/t);
+  printf(1, "\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc > 1)
+    nblocks = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(nblocks <= 0 || nblocks > MAXFILE || rounds <= 0){
+    printf(2, "usage: bcbench [blocks [rounds]]\n");
+    exit();
+  }
+  memset(data, 'b', sizeof(data));
+
+  phase("write", writefile, nblocks*BSIZE/1024);
+  phase("read", readfile, nblocks*BSIZE/1024);
+  phase("metadata", metadata, 0);
+  unlink("bcbench.f");
+  exit();
+}
@@ -0,0 +1,13 @@
+// Buffer cache counters of one CPU, read from the
+// buffer cache statistics device.
+struct bcstat {
+  uint hit;       // Lookups that found the block cached
+  uint miss;      // Lookups that did not
+  uint ghost;     // Of the misses, blocks taken back as hot
+  uint wait;      // Hits on a buffer another process held
+  uint evcold;    // Cold buffers recycled
+  uint evhot;     // Hot buffers recycled
+  uint nearmiss;  // Evictions that found most buffers in use
+  uint grow;      // Pages of buffers added to the cache
+  uint reclaim;   // Pages of buffers given back to kalloc()
+};
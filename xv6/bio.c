@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,94 +17,557 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_PENDING: the log has committed the buffer but not yet
+//     installed it at its home location; it stays B_DIRTY
+//     until the log's next checkpoint writes it.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "file.h"
+#include "bcstat.h"
 
-struct {
+// Buffers are found through a hash table keyed on (dev, blockno),
+// each bucket with its own lock, so cache hits on different
+// buckets do not contend. A buffer's refcnt is protected by the
+// lock of its bucket. Only one CPU replaces a buffer at a time,
+// under bcache.lock.
+//
+// The cache starts with the NBUF buffers in bcache.buf and grows
+// a page of buffers at a time from kalloc(), up to 1/BCACHEFRAC
+// of physical memory. When kalloc() runs out it calls breclaim()
+// to give back a page whose buffers are all unused.
+//
+// Replacement follows 2Q. A block read in for the first time is
+// cold; one read in again soon after being evicted from the cold
+// set (it is still in the ghost list) is hot. While more than a
+// quarter of the buffers are cold, the cold ones are replaced
+// first, so a long sequential scan only displaces blocks that
+// were themselves used once. Otherwise hot buffers are replaced
+// by CLOCK: a clock hand sweeps the ring of all buffers, and a
+// buffer used since the hand last passed gets a second chance.
+//
+// With BCACHE2Q off, replacement is plain LRU instead, as a
+// baseline for 2Q: bdone() moves a buffer it leaves unused to
+// the front of the ring, at bcache.hand, and blru() recycles
+// the unused buffer nearest the back. The ring is then kept
+// under bcache.lock, which every release takes.
+#define NBUCKET 31
+#define BHASH(dev, blockno) (((dev)*NBUCKET/2 + (blockno)) % NBUCKET)
+#define BPERPAGE ((PGSIZE - sizeof(struct bufpage*)) / sizeof(struct buf))
+#define NGHOST NBUF  // blocks recently evicted while cold
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;  // chain through hnext
+  struct ghost *ghost;  // ghosts of its blocks, under bcache.lock
+};
+
+struct bufpage {
+  struct bufpage *next;
+  struct buf buf[BPERPAGE];
+};
+
+struct ghost {
+  uint dev;
+  uint blockno;
+  struct ghost *next;  // bucket's ghost chain
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;  // held while replacing, growing or shrinking
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+  struct buf *free;  // buffers holding no block, through hnext
+  struct bufpage *pages;  // buffers allocated since boot
+  int npage;
+  struct buf *hand;  // clock hand, or front of the LRU ring
+  int nbuf;   // buffers on the ring
+  int ncold;  // buffers holding a cold block
+  struct ghost ghost[NGHOST];  // hashed into the buckets too
+  int ghostw;  // next ghost slot to overwrite
+  struct bcstat stat[NCPU];
 } bcache;
 
+static int bcstatread(struct inode*, char*, uint, int);
+
+static struct bucket*
+bucketof(uint dev, uint blockno)
+{
+  return &bcache.bucket[BHASH(dev, blockno)];
+}
+
+// This CPU's counters. The caller holds a spinlock,
+// so it cannot move to another CPU.
+static struct bcstat*
+mystat(void)
+{
+  return &bcache.stat[cpuid()];
+}
+
+// Put the n buffers starting at b on the free list
+// and on the clock ring.
+static void
+badd(struct buf *b, int n)
+{
+  for(; n > 0; b++, n--){
+    b->dev = NODEV;
+    b->hnext = bcache.free;
+    bcache.free = b;
+    if(bcache.hand == 0){
+      b->cnext = b->cprev = b;
+      bcache.hand = b;
+    } else {
+      b->cnext = bcache.hand;
+      b->cprev = bcache.hand->cprev;
+      b->cprev->cnext = b;
+      bcache.hand->cprev = b;
+    }
+    bcache.nbuf++;
+    initsleeplock(&b->lock, "buffer");
+  }
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  struct ghost *g;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  for(g = bcache.ghost; g < bcache.ghost+NGHOST; g++)
+    g->dev = NODEV;
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  badd(bcache.buf, NBUF);
+  devsw[BCSTAT].read = bcstatread;
+}
+
+// Find the buffer for block blockno of dev in bucket bk,
+// whose lock the caller holds.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Remove b from the free list or from its bucket.
+// The caller holds bcache.lock and the lock of b's bucket.
+static void
+bunlink(struct buf *b)
+{
+  struct buf **pp;
+
+  if(b->dev == NODEV)
+    pp = &bcache.free;
+  else
+    pp = &bucketof(b->dev, b->blockno)->head;
+  for(; *pp != b; pp = &(*pp)->hnext)
+    ;
+  *pp = b->hnext;
+  if(b->dev != NODEV && !b->hot)
+    bcache.ncold--;
+}
+
+// Is b a buffer that may be recycled?
+// Even if refcnt==0, B_DIRTY indicates a buffer is in use
+// because log.c has modified it but not yet committed it.
+static int
+bidle(struct buf *b)
+{
+  return b->refcnt == 0 && (b->flags & B_DIRTY) == 0;
+}
+
+// Was block blockno of dev evicted while cold not long ago?
+// Forgets it if so. The caller holds bcache.lock.
+static int
+bghost(uint dev, uint blockno)
+{
+  struct ghost **pp, *g;
+
+  for(pp = &bucketof(dev, blockno)->ghost; (g = *pp) != 0; pp = &g->next){
+    if(g->dev == dev && g->blockno == blockno){
+      *pp = g->next;
+      g->dev = NODEV;
+      return 1;
+    }
   }
+  return 0;
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Remember cold buffer b's block in the oldest ghost slot.
+// The caller holds bcache.lock.
+static void
+baddghost(struct buf *b)
+{
+  struct ghost **pp, *g;
+  struct bucket *bk;
+
+  g = &bcache.ghost[bcache.ghostw];
+  bcache.ghostw = (bcache.ghostw + 1) % NGHOST;
+  if(g->dev != NODEV){
+    pp = &bucketof(g->dev, g->blockno)->ghost;
+    for(; *pp != g; pp = &(*pp)->next)
+      ;
+    *pp = g->next;
+  }
+  g->dev = b->dev;
+  g->blockno = b->blockno;
+  bk = bucketof(b->dev, b->blockno);
+  g->next = bk->ghost;
+  bk->ghost = g;
+}
+
+// Should the clock hand pass over idle buffer b
+// on its first two sweeps?
+static int
+bskip(struct buf *b)
+{
+  int coldfull;
+
+  coldfull = bcache.ncold > bcache.nbuf/4;
+  if(!b->hot)
+    return !coldfull;
+  if(coldfull)
+    return 1;
+  if(b->ref){
+    b->ref = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Take an unused buffer out of its bucket, chosen by the
+// clock hand. The caller holds bcache.lock and the lock
+// of bucket bk.
 static struct buf*
-bget(uint dev, uint blockno)
+bevict(struct bucket *bk)
 {
   struct buf *b;
+  struct bucket *vb;
+  int n, busy;
 
-  acquire(&bcache.lock);
+  busy = 0;
+  for(n = 0; ; n++){
+    // After two full sweeps any idle buffer will do.
+    if(n >= 3*bcache.nbuf)
+      panic("bget: no buffers");
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+    // These reads are not locked, so recheck the choice below.
+    if(!bidle(b)){
+      busy++;
+      continue;
+    }
+    if(n < 2*bcache.nbuf && bskip(b))
+      continue;
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+    vb = bucketof(b->dev, b->blockno);
+    if(vb != bk)
+      acquire(&vb->lock);
+    if(bidle(b)){
+      if(busy > bcache.nbuf/2)
+        mystat()->nearmiss++;
+      if(b->hot){
+        mystat()->evhot++;
+      } else {
+        mystat()->evcold++;
+        baddghost(b);
+      }
+      bunlink(b);
+      if(vb != bk)
+        release(&vb->lock);
       return b;
     }
+    if(vb != bk)
+      release(&vb->lock);
   }
+}
+
+// Take the least recently used unused buffer out of its
+// bucket, for plain LRU replacement. The caller holds
+// bcache.lock and the lock of bucket bk.
+static struct buf*
+blru(struct bucket *bk)
+{
+  struct buf *b;
+  struct bucket *vb;
+  int n;
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  b = bcache.hand;
+  for(n = 0; n < bcache.nbuf; n++){
+    b = b->cprev;
+    if(!bidle(b))
+      continue;
+    vb = bucketof(b->dev, b->blockno);
+    if(vb != bk)
+      acquire(&vb->lock);
+    if(bidle(b)){
+      if(n > bcache.nbuf/2)
+        mystat()->nearmiss++;
+      mystat()->evhot++;
+      bunlink(b);
+      if(vb != bk)
+        release(&vb->lock);
       return b;
     }
+    if(vb != bk)
+      release(&vb->lock);
   }
   panic("bget: no buffers");
 }
 
+// Move b to the front of the LRU ring.
+// The caller holds bcache.lock.
+static void
+bmru(struct buf *b)
+{
+  if(b == bcache.hand)
+    return;
+  b->cprev->cnext = b->cnext;
+  b->cnext->cprev = b->cprev;
+  b->cnext = bcache.hand;
+  b->cprev = bcache.hand->cprev;
+  b->cprev->cnext = b;
+  bcache.hand->cprev = b;
+  bcache.hand = b;
+}
+
+// Add a page of buffers to the free list, if the cache
+// may grow. The caller holds bcache.lock.
+static int
+bgrow(void)
+{
+  struct bufpage *p;
+
+  if(bcache.npage >= kpages() / BCACHEFRAC)
+    return 0;
+  if((p = (struct bufpage*)kalloc()) == 0)
+    return 0;
+  memset(p, 0, PGSIZE);
+  badd(p->buf, BPERPAGE);
+  p->next = bcache.pages;
+  bcache.pages = p;
+  bcache.npage++;
+  mystat()->grow++;
+  return 1;
+}
+
+// Give a page of unused buffers back to kalloc().
+// Returns 1 if it freed a page, 0 if none could be freed.
+int
+breclaim(void)
+{
+  struct bufpage *p, **pp;
+  struct bucket *bk;
+  struct buf *b;
+
+  // bgrow() calls kalloc() with bcache.lock held.
+  if(holding(&bcache.lock))
+    return 0;
+
+  acquire(&bcache.lock);
+  // Locking every bucket keeps the pages' buffers from
+  // being found while they are checked and unlinked.
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    acquire(&bk->lock);
+  for(pp = &bcache.pages; (p = *pp) != 0; pp = &p->next){
+    for(b = p->buf; b < p->buf+BPERPAGE; b++)
+      if(!bidle(b))
+        break;
+    if(b == p->buf+BPERPAGE)
+      break;
+  }
+  if(p){
+    *pp = p->next;
+    for(b = p->buf; b < p->buf+BPERPAGE; b++){
+      bunlink(b);
+      if(bcache.hand == b)
+        bcache.hand = b->cnext;
+      b->cprev->cnext = b->cnext;
+      b->cnext->cprev = b->cprev;
+      bcache.nbuf--;
+    }
+    bcache.npage--;
+    mystat()->reclaim++;
+  }
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    release(&bk->lock);
+  release(&bcache.lock);
+
+  if(p == 0)
+    return 0;
+  kfree((char*)p);
+  return 1;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer, except that
+// with nowait a cached block yields 0 instead.
+static struct buf*
+bget(uint dev, uint blockno, int nowait)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  bk = bucketof(dev, blockno);
+  acquire(&bk->lock);
+
+  // Is the block already cached?
+  if((b = bfind(bk, dev, blockno)) != 0){
+    if(nowait){
+      release(&bk->lock);
+      return 0;
+    }
+    b->refcnt++;
+    b->ref = 1;
+    mystat()->hit++;
+    if(b->lock.locked)
+      mystat()->wait++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  // Not cached; take a free buffer, growing the cache if it
+  // may, or else recycle an unused one. Another CPU may have
+  // cached the block meanwhile, so look again first.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    if(!nowait){
+      b->refcnt++;
+      b->ref = 1;
+      mystat()->hit++;
+      if(b->lock.locked)
+        mystat()->wait++;
+    }
+    release(&bk->lock);
+    release(&bcache.lock);
+    if(nowait)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
+  mystat()->miss++;
+  if(bcache.free == 0)
+    bgrow();
+  if((b = bcache.free) != 0)
+    bcache.free = b->hnext;
+  else if(BCACHE2Q)
+    b = bevict(bk);
+  else
+    b = blru(bk);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->ref = 0;
+  b->hot = !BCACHE2Q || bghost(dev, blockno);
+  if(b->hot && BCACHE2Q)
+    mystat()->ghost++;
+  if(!b->hot)
+    bcache.ncold++;
+  b->refcnt = 1;
+  // Lock b before others can find it, so no one else
+  // reads it in. This does not sleep: b was unused.
+  acquiresleep(&b->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  return b;
+}
+
 // Return a locked buf with the contents of the indicated block.
 struct buf*
 bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if((b->flags & B_VALID) == 0) {
     iderw(b);
   }
   return b;
 }
 
+// Return a locked buf for the indicated block without
+// reading it from disk, for a caller that will overwrite
+// all of its data. A cached block keeps its contents.
+struct buf*
+bgetnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// Start reading the indicated block into the cache,
+// unless it is already there, without waiting for the
+// disk. The disk interrupt releases the buffer.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 1)) == 0)
+    return;
+  b->done = bdone;
+  bsubmit(b);
+}
+
+// Start the disk on locked b: write it if B_DIRTY is set,
+// else read it. Returns without waiting. If b->done is set,
+// the disk interrupt calls it when b is finished, and it
+// takes over b; otherwise the caller must bwait(b).
+void
+bsubmit(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bsubmit");
+  idesubmit(b);
+}
+
+// Wait for the disk to finish the request bsubmit()
+// started for b, which has no done function.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  ideawait(b);
+}
+
+// The disk has finished b, which has a done function:
+// call it. Called from the disk interrupt, with no
+// locks held.
+void
+bcomplete(struct buf *b)
+{
+  void (*done)(struct buf*);
+
+  done = b->done;
+  b->done = 0;
+  done(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -116,28 +579,79 @@ bwrite(struct buf *b)
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
+  bdone(b);
+}
+
+// Release b. A done function can call this from the disk
+// interrupt, which does not hold b's sleeplock in its own
+// name.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bucketof(b->dev, b->blockno);
+  if(!BCACHE2Q)
+    acquire(&bcache.lock);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  if(!BCACHE2Q && b->refcnt == 0)
+    bmru(b);
+  release(&bk->lock);
+  if(!BCACHE2Q)
+    release(&bcache.lock);
+}
+
+// Print buffer cache counters, summed over CPUs, to the
+// console. Runs when user types ^P on console.
+void
+bcachedump(void)
+{
+  struct bcstat *st, t;
+
+  memset(&t, 0, sizeof(t));
+  for(st = bcache.stat; st < bcache.stat+ncpu; st++){
+    t.hit += st->hit;
+    t.miss += st->miss;
+    t.ghost += st->ghost;
+    t.wait += st->wait;
+    t.evcold += st->evcold;
+    t.evhot += st->evhot;
+    t.nearmiss += st->nearmiss;
+    t.grow += st->grow;
+    t.reclaim += st->reclaim;
   }
-  
-  release(&bcache.lock);
+  cprintf("bcache: %d bufs %d cold; %d hits %d misses %d ghost hits"
+          " %d waits; evicted %d cold %d hot, %d near misses;"
+          " %d pages grown %d reclaimed\n", bcache.nbuf, bcache.ncold,
+          t.hit, t.miss, t.ghost, t.wait, t.evcold, t.evhot,
+          t.nearmiss, t.grow, t.reclaim);
+}
+
+// Copy the counters of each CPU, from the one at file
+// offset off on, to dst, for reads of the buffer cache
+// statistics device. Past the last CPU it returns 0,
+// the end of the file. Not locked: the counters are only
+// statistics.
+static int
+bcstatread(struct inode *ip, char *dst, uint off, int n)
+{
+  int i, r;
+
+  r = 0;
+  i = off / sizeof(struct bcstat);
+  for(; i < ncpu && n - r >= sizeof(struct bcstat); i++){
+    memmove(dst + r, &bcache.stat[i], sizeof(struct bcstat));
+    r += sizeof(struct bcstat);
+  }
+  return r;
 }
 //PAGEBREAK!
 // Blank page.
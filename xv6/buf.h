@@ -4,11 +4,18 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  struct buf *hnext; // hash chain
+  struct buf *cnext; // clock ring of all buffers
+  struct buf *cprev;
+  uchar hot;         // used again after eviction, see bio.c
+  uchar ref;         // used since the clock hand passed
   struct buf *qnext; // disk queue
+  void (*done)(struct buf*); // called when disk is done, see bsubmit()
   uchar data[BSIZE];
 };
+#define NODEV ((uint)-1)  // dev of a buffer that holds no block
+
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_PENDING 0x8  // committed in the log, not yet installed
 
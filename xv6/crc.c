@@ -0,0 +1,76 @@
+// CRC32C (Castagnoli) checksums, used by the log.
+//
+// Uses the SSE4.2 crc32 instruction when the CPU has it,
+// and otherwise a slice-by-8 table lookup that consumes
+// eight bytes per step.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+
+#define CRC32C_POLY 0x82F63B78  // reflected Castagnoli polynomial
+#define CPUID_SSE42 (1<<20)     // readcpuid(1) %ecx: SSE4.2 present
+
+static uint crctab[8][256];
+static int hwcrc;
+
+void
+crcinit(void)
+{
+  uint c, ecx;
+  int i, j;
+
+  for(i = 0; i < 256; i++){
+    c = i;
+    for(j = 0; j < 8; j++)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crctab[0][i] = c;
+  }
+  for(i = 0; i < 256; i++)
+    for(j = 1; j < 8; j++)
+      crctab[j][i] = (crctab[j-1][i] >> 8) ^ crctab[0][crctab[j-1][i] & 0xff];
+
+  readcpuid(1, 0, 0, &ecx, 0);
+  hwcrc = (ecx & CPUID_SSE42) != 0;
+}
+
+static uint
+crchw(uint c, const uchar *p, uint n)
+{
+  for(; n >= 4; n -= 4, p += 4)
+    asm volatile("crc32l %1, %0" : "+r" (c) : "rm" (*(uint*)p));
+  for(; n > 0; n--, p++)
+    asm volatile("crc32b %1, %0" : "+r" (c) : "rm" (*p));
+  return c;
+}
+
+static uint
+crcsw(uint c, const uchar *p, uint n)
+{
+  uint lo, hi;
+
+  for(; n >= 8; n -= 8, p += 8){
+    lo = *(uint*)p ^ c;
+    hi = *(uint*)(p+4);
+    c = crctab[7][lo & 0xff] ^ crctab[6][(lo >> 8) & 0xff] ^
+        crctab[5][(lo >> 16) & 0xff] ^ crctab[4][lo >> 24] ^
+        crctab[3][hi & 0xff] ^ crctab[2][(hi >> 8) & 0xff] ^
+        crctab[1][(hi >> 16) & 0xff] ^ crctab[0][hi >> 24];
+  }
+  for(; n > 0; n--, p++)
+    c = (c >> 8) ^ crctab[0][(c ^ *p) & 0xff];
+  return c;
+}
+
+// Extend crc (0 to start) over n bytes at p.
+uint
+crc32c(uint crc, const void *p, uint n)
+{
+  uint c = ~crc;
+
+  if(hwcrc)
+    c = crchw(c, p, n);
+  else
+    c = crcsw(c, p, n);
+  return ~c;
+}
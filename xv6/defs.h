@@ -11,9 +11,17 @@ struct stat;
 struct superblock;
 
 // bio.c
+void            bcachedump(void);
+void            bcomplete(struct buf*);
+void            bdone(struct buf*);
+struct buf*     bgetnew(uint, uint);
 void            binit(void);
+int             breclaim(void);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
 void            brelse(struct buf*);
+void            bsubmit(struct buf*);
+void            bwait(struct buf*);
 void            bwrite(struct buf*);
 
 // console.c
@@ -22,6 +30,10 @@ void            cprintf(char*, ...);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 
+// crc.c
+void            crcinit(void);
+uint            crc32c(uint, const void*, uint);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -45,6 +57,7 @@ void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+int             iputblocks(void);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
@@ -52,11 +65,14 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
+int             writeiblocks(int);
 
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
+void            ideawait(struct buf*);
 void            iderw(struct buf*);
+void            idesubmit(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -68,6 +84,7 @@ char*           kalloc(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+int             kpages(void);
 
 // kbd.c
 void            kbdintr(void);
@@ -84,8 +101,11 @@ void            microdelay(int);
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
-void            begin_op();
+void            log_zero(struct buf*);
+void            log_write_range(struct buf*, uint, uint);
+void            begin_op(int);
 void            end_op();
+void            log_force(void);
 
 // mp.c
 extern int      ismp;
@@ -95,6 +115,11 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// pci.c
+int             pcifind(int, uint, uint);
+uint            pciread(int, int);
+void            pciwrite(int, int, uint);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -108,6 +133,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+int             kthread(char*, void(*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
@@ -170,6 +196,12 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 
+// virtio.c
+int             virtioinit(void);
+int             virtiointr(int);
+void            virtioawait(struct buf*);
+void            virtiosubmit(struct buf*);
+
 // vm.c
 void            seginit(void);
 void            kvmalloc(void);
@@ -19,7 +19,7 @@ exec(char *path, char **argv)
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
-  begin_op();
+  begin_op(2*iputblocks());  // namei() and the final iunlockput()
 
   if((ip = namei(path)) == 0){
     end_op();
@@ -23,15 +23,22 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  uint ranext;        // block a sequential readi() reads next
+  uint rawin;         // blocks to read ahead of it
+  uint raend;         // blocks before this were read ahead
 };
 
 // table mapping major device number to
-// device functions
+// device functions. read also gets the file offset,
+// so that a device can give its file an end.
 struct devsw {
-  int (*read)(struct inode*, char*, int);
+  int (*read)(struct inode*, char*, uint, int);
   int (*write)(struct inode*, char*, int);
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define LOGSTAT 2
+#define BCSTAT 3
@@ -22,6 +22,7 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 static void itrunc(struct inode*);
 // there should be one superblock per disk device, but we run with
 // only one device
@@ -44,9 +45,9 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bgetnew(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  log_zero(bp);
   brelse(bp);
 }
 
@@ -66,7 +67,7 @@ balloc(uint dev)
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
         bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
+        log_write_range(bp, bi/8, 1);
         brelse(bp);
         bzero(dev, b + bi);
         return b + bi;
@@ -90,7 +91,7 @@ bfree(int dev, uint b)
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
-  log_write(bp);
+  log_write_range(bp, bi/8, 1);
   brelse(bp);
 }
 
@@ -204,7 +205,7 @@ ialloc(uint dev, short type)
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
+      log_write_range(bp, (char*)dip - (char*)bp->data, sizeof(*dip));   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
     }
@@ -231,7 +232,7 @@ iupdate(struct inode *ip)
   dip->nlink = ip->nlink;
   dip->size = ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-  log_write(bp);
+  log_write_range(bp, (char*)dip - (char*)bp->data, sizeof(*dip));
   brelse(bp);
 }
 
@@ -305,6 +306,7 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->ranext = ip->rawin = ip->raend = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -390,7 +392,7 @@ bmap(struct inode *ip, uint bn)
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
       a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+      log_write_range(bp, bn*sizeof(uint), sizeof(uint));
     }
     brelse(bp);
     return addr;
@@ -399,6 +401,29 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Return the disk block address of the nth block in inode ip,
+// or 0 if there is no such block. Never allocates.
+static uint
+bmapread(struct inode *ip, uint bn)
+{
+  uint addr;
+  struct buf *bp;
+
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if(bn < NINDIRECT){
+    if((addr = ip->addrs[NDIRECT]) == 0)
+      return 0;
+    bp = bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn];
+    brelse(bp);
+    return addr;
+  }
+  return 0;
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -447,6 +472,34 @@ stati(struct inode *ip, struct stat *st)
 }
 
 //PAGEBREAK!
+// Start reading blocks past first..last of ip, which readi()
+// is about to read, if ip is being read sequentially. The
+// number of blocks read ahead doubles with each sequential
+// read, up to READAHEAD, and drops to zero on a seek.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, addr;
+
+  if(first != ip->ranext && first+1 != ip->ranext){
+    ip->rawin = 0;
+    ip->raend = 0;
+  } else if(last >= ip->ranext && ip->rawin < READAHEAD)
+    ip->rawin = ip->rawin ? min(2*ip->rawin, READAHEAD) : 1;
+  ip->ranext = last + 1;
+  if(ip->rawin == 0)
+    return;
+
+  end = min(last + 1 + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  for(bn = max(last + 1, ip->raend); bn < end; bn++){
+    if((addr = bmapread(ip, bn)) == 0)
+      break;
+    breadahead(ip->dev, addr);
+  }
+  if(bn > ip->raend)
+    ip->raend = bn;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 int
@@ -458,13 +511,15 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
       return -1;
-    return devsw[ip->major].read(ip, dst, n);
+    return devsw[ip->major].read(ip, dst, off, n);
   }
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, off/BSIZE, (off + n - 1)/BSIZE);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -499,7 +554,10 @@ writei(struct inode *ip, char *src, uint off, uint n)
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    // Data blocks log only the bytes written too, so
+    // that small appends, like a log file's, share log
+    // blocks; a write of most of a block logs it whole.
+    log_write_range(bp, off%BSIZE, m);
     brelse(bp);
   }
 
@@ -510,6 +568,29 @@ writei(struct inode *ip, char *src, uint off, uint n)
   return n;
 }
 
+// Log blocks a writei() of n bytes can write: the data
+// blocks it spans, a bitmap block for each of them and for
+// an indirect block, the indirect block and the inode.
+int
+writeiblocks(int n)
+{
+  int nb, nbmap;
+
+  nb = (n + BSIZE-2)/BSIZE + 1;
+  nbmap = nb + 1;
+  if(nbmap > sb.size/BPB + 1)
+    nbmap = sb.size/BPB + 1;
+  return nb + nbmap + 2;
+}
+
+// Log blocks an iput() can write when it frees the inode:
+// every bitmap block and the inode.
+int
+iputblocks(void)
+{
+  return sb.size/BPB + 1 + 1;
+}
+
 //PAGEBREAK!
 // Directories
 
@@ -8,6 +8,7 @@
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
+// The log may instead be on the boot disk, past the kernel.
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -19,6 +20,17 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint logdev;       // Device holding the log
+  uint logid;        // Tags the log of this file system
+};
+
+// The first log block is the checkpoint block. It records how
+// much of the log has been installed; see log.c.
+struct logckpt {
+  uint seq;    // last installed transaction
+  int tail;    // log ring position of the next transaction's record
+  uint clean;  // no record has been written since the checkpoint
+  uint id;     // superblock's logid
 };
 
 #define NDIRECT 12
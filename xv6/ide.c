@@ -1,4 +1,6 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code. Moves data by bus-master DMA when the
+// PCI IDE controller supports it, as QEMU's PIIX does, and by
+// PIO otherwise.
 
 #include "types.h"
 #include "defs.h"
@@ -23,16 +25,67 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+
+// Bus-master DMA registers, from the controller's BAR4.
+#define BM_CMD        0     // command
+#define BM_STATUS     2     // status
+#define BM_PRD        4     // physical address of the PRD table
+#define BM_START      0x01  // BM_CMD: start the transfer
+#define BM_READ       0x08  // BM_CMD: transfer to memory
+#define BM_ACTIVE     0x01  // BM_STATUS: transfer under way
+#define BM_ERR        0x02  // BM_STATUS: error; write 1 to clear
+#define BM_INTR       0x04  // BM_STATUS: disk interrupted; write 1 to clear
+#define BM_DMACAP     0x60  // BM_STATUS: drives 0 and 1 can do DMA; keep
+#define PRD_EOT       0x8000  // last entry of the PRD table
+
+#define IDE_MAXSECT   256  // sectors one command may move
+#define IDE_MULT      16   // sectors per interrupt we ask for
+#define IDE_SWEEP     64   // bufs that may join a sweep under way
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
 // You must hold idelock while manipulating queue.
+//
+// The queue is in C-LOOK order: after the request in progress
+// come the bufs for blocks past it in ascending order (this
+// sweep), then the rest in ascending order (the next sweep).
+// Only IDE_SWEEP bufs may join a sweep once it has begun, so a
+// stream of ascending requests cannot starve the next sweep.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *ideactive;   // last buf of the request in progress
+static struct buf *idecurend;   // last buf of this sweep, if any
+static struct buf *idenextend;  // last buf of the next sweep, if any
+static int idesweepn;           // bufs that joined this sweep late
 
 static int havedisk1;
+static int usevirtio;   // disk 1 is a virtio-blk disk
+static int idemult[2];  // sectors per interrupt, per drive
 static void idestart(struct buf*);
+static void idecmd(struct buf*);
+static void idexferblock(int, int);
+
+// Physical region descriptor: a piece of memory a DMA
+// transfer fills or drains, not crossing 64KB.
+struct prd {
+  uint addr;
+  ushort len;  // 0 means 64KB
+  ushort flags;
+};
+
+static ushort idebm;       // bus-master registers, or 0 for PIO
+static struct prd *ideprd; // PRD table, one page
+
+// The request in progress covers the first bufs on idequeue.
+static int idensect;        // sectors in it
+static int idexfer;         // of them, sectors moved so far
+static struct buf *idexb;   // buf the next sector belongs to
+static int idexoff;         // offset of that sector in idexb
+static int idexdma;         // moved by DMA, not PIO?
 
 // Wait for IDE disk to become ready.
 static int
@@ -50,9 +103,11 @@ idewait(int checkerr)
 void
 ideinit(void)
 {
-  int i;
+  int i, tag;
+  uint bar;
 
   initlock(&idelock, "ide");
+  usevirtio = virtioinit();
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
 
@@ -65,37 +120,170 @@ ideinit(void)
     }
   }
 
+  // Have each disk move IDE_MULT sectors per interrupt in
+  // READ/WRITE MULTIPLE, if it can, with interrupts masked.
+  outb(0x3f6, 2);
+  for(i = 0; i <= havedisk1; i++){
+    outb(0x1f6, 0xe0 | (i<<4));
+    outb(0x1f2, IDE_MULT);
+    outb(0x1f7, IDE_CMD_SETMUL);
+    idemult[i] = idewait(1) < 0 ? 1 : IDE_MULT;
+  }
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  // Find the PCI IDE controller (class 1, subclass 1) and, if
+  // it can bus master, let it. Our disks are on the primary
+  // channel, whose registers start at BAR4.
+  if((tag = pcifind(0x08, 0x01010000, 0xffff0000)) >= 0 &&
+     ((bar = pciread(tag, 0x20)) & 1) &&
+     (pciread(tag, 0x08) & 0x8000) &&
+     (ideprd = (struct prd*)kalloc()) != 0){
+    pciwrite(tag, 0x04, pciread(tag, 0x04) | 0x5);  // I/O, bus master
+    idebm = bar & 0xfffc;
+  }
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Start the request for b, merged with the requests queued
+// after it for the blocks that follow on the same disk in the
+// same direction. Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *q;
+  int sector_per_block, nsect;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  if(b->blockno >= ((b->dev & 1) ? FSSIZE : BOOTSIZE))
     panic("incorrect blockno");
-  int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  sector_per_block =  BSIZE/SECTOR_SIZE;
 
   if (sector_per_block > 7) panic("idestart");
 
+  // This sweep is done; start the next one.
+  if(idecurend == 0){
+    idecurend = idenextend;
+    idenextend = 0;
+    idesweepn = 0;
+  }
+
+  // Take in the run of queued bufs that continue b,
+  // up to the end of this sweep.
+  nsect = sector_per_block;
+  for(q = b; q != idecurend && q->qnext != 0; q = q->qnext){
+    if(q->qnext->dev != b->dev ||
+       q->qnext->blockno != q->blockno + 1 ||
+       (q->qnext->flags & B_DIRTY) != (b->flags & B_DIRTY) ||
+       nsect + sector_per_block > IDE_MAXSECT)
+      break;
+    nsect += sector_per_block;
+  }
+  if(q == idecurend)
+    idecurend = 0;
+  ideactive = q;
+  idensect = nsect;
+  idecmd(b);
+}
+
+// Point the PRD table at the data of the bufs from b
+// to ideactive, splitting pieces that cross 64KB.
+static void
+ideprdfill(struct buf *b)
+{
+  struct prd *p;
+  uint pa, n;
+  int off;
+
+  p = ideprd;
+  for(;; b = b->qnext){
+    for(off = 0; off < BSIZE; off += n, p++){
+      pa = V2P(b->data + off);
+      n = BSIZE - off;
+      if(pa/0x10000 != (pa + n - 1)/0x10000)
+        n = 0x10000 - pa%0x10000;
+      p->addr = pa;
+      p->len = n;
+      p->flags = 0;
+    }
+    if(b == ideactive)
+      break;
+  }
+  p[-1].flags = PRD_EOT;
+}
+
+// Issue the command for the request in progress, which
+// starts with b. Caller must hold idelock.
+static void
+idecmd(struct buf *b)
+{
+  int sector_per_block, sector, drive, multi;
+  int read_cmd, write_cmd;
+
+  sector_per_block =  BSIZE/SECTOR_SIZE;
+  sector = b->blockno * sector_per_block;
+  drive = b->dev & 1;
+  idexfer = 0;
+  idexb = b;
+  idexoff = 0;
+  idexdma = idebm != 0;
+
+  if(idexdma){
+    ideprdfill(b);
+    read_cmd = IDE_CMD_RDDMA;
+    write_cmd = IDE_CMD_WRDMA;
+    outl(idebm+BM_PRD, V2P(ideprd));
+    outb(idebm+BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_READ);
+    outb(idebm+BM_STATUS, (inb(idebm+BM_STATUS) & BM_DMACAP) | BM_ERR|BM_INTR);
+  } else {
+    multi = idemult[drive] > 1;
+    read_cmd = multi ? IDE_CMD_RDMUL : IDE_CMD_READ;
+    write_cmd = multi ? IDE_CMD_WRMUL : IDE_CMD_WRITE;
+  }
+
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, idensect & 0xff);  // number of sectors; 0 means 256
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
+  outb(0x1f6, 0xe0 | (drive<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    if(idexdma)
+      outb(idebm+BM_CMD, BM_START);
+    else
+      idexferblock(drive, 1);
   } else {
     outb(0x1f7, read_cmd);
+    if(idexdma)
+      outb(idebm+BM_CMD, BM_READ|BM_START);
+  }
+}
+
+// Move the next DRQ block of the request in progress, which
+// is idemult[drive] sectors or what remains, between the
+// disk and the bufs; out says which way.
+static void
+idexferblock(int drive, int out)
+{
+  int n;
+
+  n = idensect - idexfer;
+  if(n > idemult[drive])
+    n = idemult[drive];
+  for(; n > 0; n--){
+    if(out)
+      outsl(0x1f0, idexb->data + idexoff, SECTOR_SIZE/4);
+    else
+      insl(0x1f0, idexb->data + idexoff, SECTOR_SIZE/4);
+    idexfer++;
+    idexoff += SECTOR_SIZE;
+    if(idexoff == BSIZE){
+      idexb = idexb->qnext;
+      idexoff = 0;
+    }
   }
 }
 
@@ -103,66 +291,174 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *done, *next;
+  int drive, n, st;
 
-  // First queued buffer is the active request.
+  // First queued buffers are the active request.
   acquire(&idelock);
 
   if((b = idequeue) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
+  drive = b->dev & 1;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(idexdma){
+    // The controller moved the data; check that it is done.
+    st = inb(idebm+BM_STATUS);
+    if((st & (BM_INTR|BM_ERR)) == 0){
+      release(&idelock);
+      return;
+    }
+    outb(idebm+BM_CMD, 0);
+    outb(idebm+BM_STATUS, (st & BM_DMACAP) | BM_ERR|BM_INTR);
+    if(idewait(1) < 0 || (st & BM_ERR)){
+      // Give up on DMA and redo the request by PIO.
+      cprintf("ide: DMA failed, using PIO\n");
+      idebm = 0;
+      idecmd(idequeue);
+      release(&idelock);
+      return;
+    }
+  } else if(idewait(1) >= 0){
+    // Move data if needed. A request spanning several DRQ
+    // blocks interrupts once per block.
+    if(!(b->flags & B_DIRTY))
+      idexferblock(drive, 0);
+    if(idexfer < idensect){
+      if(b->flags & B_DIRTY)
+        idexferblock(drive, 1);
+      release(&idelock);
+      return;
+    }
+  }
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for the request's bufs.
+  done = 0;
+  for(n = 0; n < idensect; n += BSIZE/SECTOR_SIZE){
+    b = idequeue;
+    idequeue = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->done){
+      b->qnext = done;
+      done = b;
+    } else
+      wakeup(b);
+  }
+  ideactive = 0;
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
     idestart(idequeue);
 
   release(&idelock);
+
+  // Hand bufs with a done function over to it.
+  for(; done; done = next){
+    next = done->qnext;
+    bcomplete(done);
+  }
+}
+
+// Does a's block come before b's on the disks?
+static int
+idebefore(struct buf *a, struct buf *b)
+{
+  return a->dev < b->dev || (a->dev == b->dev && a->blockno < b->blockno);
+}
+
+// Insert b into idequeue in C-LOOK order.
+// Caller must hold idelock.
+static void
+ideinsert(struct buf *b)
+{
+  struct buf *prev, **end;
+
+  if(idequeue == 0){
+    b->qnext = 0;
+    idequeue = idecurend = b;
+    return;
+  }
+
+  if(idesweepn < IDE_SWEEP && idebefore(ideactive, b)){
+    // The head has yet to pass b's block in this sweep.
+    prev = ideactive;
+    end = &idecurend;
+    idesweepn++;
+  } else {
+    prev = idecurend ? idecurend : ideactive;
+    end = &idenextend;
+  }
+
+  // A run of consecutive blocks appends in O(1);
+  // otherwise walk the sweep to b's place.
+  if(*end == 0 || idebefore(*end, b)){
+    if(*end)
+      prev = *end;
+    *end = b;
+  } else {
+    while(idebefore(prev->qnext, b))
+      prev = prev->qnext;
+  }
+  b->qnext = prev->qnext;
+  prev->qnext = b;
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
+// Start the disk on buf without waiting for it.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// When done, ideintr() calls buf->done if it is set, which
+// takes over buf; otherwise ideawait() waits for buf.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
-  struct buf **pp;
-
   if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
+    panic("idesubmit: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+    panic("idesubmit: nothing to do");
+  if(b->dev != 0 && usevirtio){
+    virtiosubmit(b);
+    return;
+  }
   if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+    panic("idesubmit: ide disk 1 not present");
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  ideinsert(b);  //DOC:insert-queue
 
   // Start disk if necessary.
   if(idequeue == b)
     idestart(b);
 
-  // Wait for request to finish.
+  release(&idelock);
+}
+
+// Wait for the request idesubmit() started for buf,
+// which has no done function, to finish.
+void
+ideawait(struct buf *b)
+{
+  if(b->dev != 0 && usevirtio){
+    virtioawait(b);
+    return;
+  }
+
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
-
-
   release(&idelock);
 }
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  ideawait(b);
+}
@@ -10,7 +10,7 @@ char *argv[] = { "sh", 0 };
 int
 main(void)
 {
-  int pid, wpid;
+  int pid, wpid, fd;
 
   if(open("console", O_RDWR) < 0){
     mknod("console", 1, 1);
@@ -19,6 +19,17 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  if((fd = open("/dev/logstat", O_RDONLY)) < 0){
+    mkdir("/dev");
+    mknod("/dev/logstat", 2, 0);
+  } else
+    close(fd);
+  if((fd = open("/dev/bcstat", O_RDONLY)) < 0){
+    mkdir("/dev");
+    mknod("/dev/bcstat", 3, 0);
+  } else
+    close(fd);
+
   for(;;){
     printf(1, "init: starting sh\n");
     pid = fork();
@@ -1,6 +1,6 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// pipe buffers, and buffer cache pages. Allocates 4096-byte pages.
 
 #include "types.h"
 #include "defs.h"
@@ -21,6 +21,7 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int npage;  // pages handed to the allocator at boot
 } kmem;
 
 // Initialization happens in two phases.
@@ -48,8 +49,18 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
     kfree(p);
+    kmem.npage++;
+  }
+}
+
+// Return the number of pages of physical memory
+// the allocator manages.
+int
+kpages(void)
+{
+  return kmem.npage;
 }
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
@@ -79,18 +90,22 @@ kfree(char *v)
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When memory runs out, shrinks the buffer cache to make room.
 char*
 kalloc(void)
 {
   struct run *r;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
-  return (char*)r;
+  for(;;){
+    if(kmem.use_lock)
+      acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r)
+      kmem.freelist = r->next;
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    if(r || !kmem.use_lock || !breclaim())
+      return (char*)r;
+  }
 }
 
@@ -1,10 +1,15 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "file.h"
+#include "logstat.h"
+#include "x86.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -14,162 +19,661 @@
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
-// A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// A system call should call begin_op(n)/end_op() to mark
+// its start and end, where n is the most blocks it can log.
+// Usually begin_op() just reserves n blocks of the open
+// transaction and returns. But if the transaction cannot
+// hold them, it sleeps until the transaction has been
+// committed. log_write() charges each block an op adds to
+// the transaction against its reservation, and end_op()
+// returns whatever is left.
+//
+// Commits are done by a dedicated committer kernel thread,
+// so end_op() never waits for the disk. The committer lets
+// a transaction stay open for up to LOGWINDOW ticks after its
+// first log_write(), so that the updates of many system calls
+// are grouped into one commit. A caller that needs its
+// updates to be durable calls log_force().
+//
+// Commits are pipelined. begin_op() is held off only while the
+// committer snapshots the transaction's blocks into pinned log
+// buffers and moves its header aside; the next transaction then
+// accumulates while the snapshot is written to the log.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   30 log blocks - 1 checksum, 1 header, 28 free blocks
+// Its length, sb.nlog, is chosen by mkfs, and so is its place:
+// normally inside the file system, but mkfs -j puts it on the
+// boot disk, so that log appends do not seek against the
+// file system's reads and installs. Every checksum is seeded
+// with sb.logid, so that a log left behind by another file
+// system is never replayed. The on-disk log format:
+//   1 checkpoint block, then a ring of nlog-1 blocks
+//
+//   1-checkpoint block, holding the sequence number of the
+//     last installed transaction, the ring position of
+//     the record of the transaction after it, and whether
+//     any record has been written since
+//   2..nlog-ring of transaction records, each one made of
+//     header blocks, the commit record: LOGMAGIC, the
+//     transaction's sequence number, block #s for block A, B, C, ...,
+//     the CRC32C of each of them and a checksum over the
+//     header itself. Only the header blocks that hold used
+//     entries are written.
+//     Then the logged copies of block A, B, C, ..., except
+//     for blocks logged as all zeros (LOG_ZERO), which the
+//     header alone describes, and blocks logged as deltas.
+//     The deltas follow, packed into LOG_PACK blocks.
+//     A logged copy that would begin with LOGMAGIC is
+//     escaped (LOG_ESCAPE): its first word is zeroed in the
+//     log and put back when it is installed. So no block of
+//     file data left in the ring can pass for a header.
 //
-//   1-checksum block, will hold the checksum in the disk
-//     for power failures and crashes
-//   2-header block, containing block #s for block A, B, C, ...
-//   3-block A
-//   4-block B
-//   5-block C
-//   ...
-//   30-block ...
+// log_write_range() marks which DELTAGRAIN-byte pieces of a
+// block changed. Unless the block is also logged whole, the
+// commit logs just those pieces, as (block, offset, length,
+// bytes) deltas, so that the updates of many inode and bitmap
+// blocks share one log block.
 // Log appends are synchronous.
+//
+// Writing a record's header is the single barrier that commits
+// its transaction. The committed blocks are not copied to their
+// home locations right away: they stay pinned in the buffer cache
+// (B_DIRTY|B_PENDING) and a checkpoint installs all of them at
+// once, when the ring or the cache is getting full or the file
+// system has been idle for LOGIDLE ticks. A block that several
+// transactions rewrite, like a bitmap or inode block, is then
+// written home only once. The checkpoint block is written after
+// the installs and frees the ring.
+//
+// Recovery skips the log if the checkpoint block is clean.
+// Otherwise it replays the records from the checkpoint position
+// on, for as long as each one has the next sequence number and
+// its header checksum and every block's CRC match.
 
+// One logged block: its home block number, the CRC32C
+// of the copy in the log, and how the block is logged.
+// In the open transaction, crc holds the mask of changed
+// pieces of a LOG_DELTA block instead.
+struct logent {
+  int block;
+  uint crc;
+  int type;
+};
+
+// Logged block types.
+#define LOG_DATA 0   // the record holds a copy of the block
+#define LOG_ZERO 1   // the block is all zeros; no copy, no crc
+#define LOG_DELTA 2  // only in memory; the changes go in LOG_PACK blocks
+#define LOG_PACK 3   // a log block of deltas; block is unused
+#define LOG_ESCAPE 4 // like LOG_DATA, but the copy's first word,
+                     // LOGMAGIC, is zeroed in the log
 
+// A delta: len bytes at offset off of block, followed by
+// the bytes. A LOG_PACK block holds deltas back to back,
+// ending with one of len 0 or at the end of the block.
+struct logdelta {
+  int block;
+  ushort off;
+  ushort len;
+};
+#define DELTAGRAIN (BSIZE/32)  // bytes per bit of a LOG_DELTA mask
+#define PACKSPACE (BSIZE - sizeof(struct logdelta))
 
-// Contents of the header block, used for both the on-disk header block
+// Contents of the header blocks, used for both the on-disk header
 // and to keep track in memory of logged block# before commit.
+// On disk, the first HEADSIZE bytes are followed directly by
+// the n used entries of ent[]. checksum covers everything after it.
 struct logheader {
+  uint magic;          // LOGMAGIC on disk
+  uint checksum;
+  uint seq;
   int n;
-  int block[LOGSIZE];
+  struct logent *ent;  // log.size entries, allocated by initlog()
+  int pos;             // ring position of the record, in memory only
 };
+#define HEADSIZE (4*sizeof(uint))
+#define LOGMAGIC 0xc03b3998  // begins every record's first header block
+#define HEADBLOCKS(n) ((HEADSIZE + (n)*sizeof(struct logent) + BSIZE-1) / BSIZE)
+
+// log_write() finds the slot of an already-logged block through a
+// small hash index kept next to the header: hhead[] holds the first
+// slot+1 of each bucket (0 if empty) and hnext[] chains the slots.
+#define LOGHASHFN(blockno) ((blockno) & (log.nhash-1))
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int ringsize;    // blocks in the ring of records.
+  int head;        // ring position for the next record.
+  int tail;        // ring position of the oldest uninstalled record.
+  int size;        // max blocks in one transaction.
+  int pincap;      // max blocks the log may keep pinned in the cache.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
-  int dev;
-  uint checksum;
-  struct logheader lh;
+  int reserved;    // blocks the executing sys calls may still log.
+  int committing;  // in snapshot() or checkpoint(), please wait.
+  int inflight;    // log buffers pinned by the transaction in commit().
+  int force;       // log_force() wants the open transaction committed.
+  uint opened;     // ticks at the first log_write() of the transaction.
+  uint idle;       // ticks at the last commit.
+  uint tid;        // seq of the open (or committing) transaction.
+  uint done;       // seq of the last transaction on disk.
+  uint retired;    // seq of the last installed transaction.
+  int clean;       // checkpoint block says no record follows it.
+  int dev;         // device holding the file system.
+  int ldev;        // device holding the log.
+  uint id;         // sb.logid, which seeds the header checksums.
+  struct logheader lh;  // the open transaction.
+  struct logheader ch;  // the transaction in commit().
+  int nhash;       // buckets in hhead[], a power of 2.
+  int *hhead;
+  int *hnext;
+  int npend;       // committed blocks not yet installed.
+  int *pend;
+  uint nabsorb;    // absorbed log_write()s in the open transaction.
+  uint waited;     // cycles begin_op() slept during the open transaction.
+  struct logstat cs;  // statistics of the transaction in commit().
+  struct logstat stat[NLOGSTAT];
+  uint statr;      // next record for logstatread().
+  uint statw;      // next record to fill.
+  int nio;         // writes logsubmit() started, not yet done.
 };
 struct log log;
 
+// Disk block holding ring position pos.
+#define RINGBLOCK(pos) (log.start + 1 + (pos) % log.ringsize)
+
 static void recover_from_log(void);
+static void committer(void);
+static void snapshot(void);
+static void clear_index(void);
 static void commit();
+static void logstat_add(struct logstat*);
+static int logstatread(struct inode*, char*, uint, int);
 void write_checksum();
 int check_checksum();
 
+// Bytes of in-memory headers and absorption index
+// needed for a transaction of size blocks.
+static uint
+logmem(int size, int nhash)
+{
+  return size*(2*sizeof(struct logent) + sizeof(int)) +
+    nhash*sizeof(int);
+}
+
+// Blocks a record for header lh takes in the ring: its
+// header blocks, a copy of each LOG_DATA and LOG_ESCAPE
+// block and the LOG_PACK blocks.
+static int
+recsize(struct logheader *lh)
+{
+  int i, n;
+
+  n = HEADBLOCKS(lh->n);
+  for (i = 0; i < lh->n; i++)
+    if (lh->ent[i].type == LOG_DATA || lh->ent[i].type == LOG_ESCAPE ||
+        lh->ent[i].type == LOG_PACK)
+      n++;
+  return n;
+}
+
+// Size the log from the superblock and allocate the in-memory
+// headers and absorption index, which share one page, and
+// the pending list.
+static void
+sizelog(struct superblock *sb)
+{
+  char *mem;
+
+  // A transaction can be no bigger than the ring, the blocks
+  // the buffer cache can keep pinned, or one page of in-memory
+  // header.
+  log.ringsize = sb->nlog - 1;
+  log.pincap = NBUF - 2*MAXOPBLOCKS;
+  if (log.pincap > PGSIZE/sizeof(int))
+    log.pincap = PGSIZE/sizeof(int);
+  log.size = log.pincap;
+  for (;;) {
+    for (log.nhash = 1; log.nhash < log.size; log.nhash *= 2)
+      ;
+    if (HEADBLOCKS(log.size) + log.size < log.ringsize &&
+        logmem(log.size, log.nhash) <= PGSIZE)
+      break;
+    log.size--;
+  }
+  if (log.size < 2*MAXOPBLOCKS)
+    panic("initlog: log too small");
+
+  if ((mem = kalloc()) == 0)
+    panic("initlog: kalloc");
+  memset(mem, 0, PGSIZE);
+  log.lh.ent = (struct logent*)mem;
+  log.ch.ent = log.lh.ent + log.size;
+  log.hnext = (int*)(log.ch.ent + log.size);
+  log.hhead = log.hnext + log.size;
+  if ((mem = kalloc()) == 0)
+    panic("initlog: kalloc");
+  log.pend = (int*)mem;
+}
+
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
   struct superblock sb;
   initlock(&log.lock, "log");
+  crcinit();
   readsb(dev, &sb);
   log.start = sb.logstart;
-  log.size = sb.nlog;
   log.dev = dev;
-  log.checksum = 0;
+  log.ldev = sb.logdev;
+  log.id = sb.logid;
+  sizelog(&sb);
   recover_from_log();
+  devsw[LOGSTAT].read = logstatread;
+  if(kthread("logcommit", committer) < 0)
+    panic("initlog: committer");
+}
+
+// Add a committed block, already B_DIRTY, to the blocks
+// the next checkpoint installs.
+static void
+addpend(struct buf *b)
+{
+  if ((b->flags & B_PENDING) == 0) {
+    b->flags |= B_PENDING;
+    log.pend[log.npend++] = b->blockno;
+  }
 }
 
-// Copy committed blocks from log to their home location
+// Called by the disk interrupt when a write logsubmit()
+// started is done.
+static void
+logwritten(struct buf *b)
+{
+  bdone(b);
+  acquire(&log.lock);
+  if (--log.nio == 0)
+    wakeup(&log.nio);
+  release(&log.lock);
+}
+
+// Start writing dirty buffer b and release it, without
+// waiting for the disk. logwait() waits for the write.
+// Putting a batch in flight at once lets the disk driver
+// sort and merge it.
+static void
+logsubmit(struct buf *b)
+{
+  acquire(&log.lock);
+  log.nio++;
+  release(&log.lock);
+  b->flags |= B_DIRTY;
+  b->done = logwritten;
+  bsubmit(b);
+}
+
+// Wait for every write logsubmit() started.
+static void
+logwait(void)
+{
+  acquire(&log.lock);
+  while (log.nio > 0)
+    sleep(&log.nio, &log.lock);
+  release(&log.lock);
+}
+
+// Write every pending block to its home location.
+static void
+install_pend(void)
+{
+  struct buf *bp;
+  int i;
+
+  for (i = 0; i < log.npend; i++) {
+    bp = bread(log.dev, log.pend[i]);
+    bp->flags &= ~B_PENDING;
+    logsubmit(bp);  // write home; also unpins
+  }
+  logwait();
+  log.npend = 0;
+}
+
+// Log blocks of the record being replayed, which
+// record_ok() reads and install_trans() releases.
+// log.inflight counts those still held.
+static struct buf *rbuf[NBUF];
+
+// A home block has been replayed into the buffer cache: pin
+// it until install_pend(), which runs early if the pending
+// list and the held log blocks fill the cache's share.
+// Installing part of a record is harmless, since recovery
+// replays every record again after a crash.
+static void
+replayed(struct buf *dbuf)
+{
+  dbuf->flags |= B_DIRTY;
+  addpend(dbuf);
+  brelse(dbuf);
+  if (log.npend + log.inflight >= log.pincap)
+    install_pend();
+}
+
+// Apply the deltas in LOG_PACK block lbuf, which the
+// caller holds, to their home blocks in the buffer cache,
+// and release it.
+static void
+install_pack(struct buf *lbuf)
+{
+  struct logdelta d;
+  struct buf *dbuf;
+  uint off;
+
+  for (off = 0; off + sizeof(d) <= BSIZE; off += sizeof(d) + d.len) {
+    memmove(&d, lbuf->data + off, sizeof(d));
+    if (d.len == 0 || off + sizeof(d) + d.len > BSIZE || d.off + d.len > BSIZE)
+      break;
+    dbuf = bread(log.dev, d.block);
+    memmove(dbuf->data + d.off, lbuf->data + off + sizeof(d), d.len);
+    replayed(dbuf);
+  }
+  brelse(lbuf);
+}
+
+// Copy the blocks of the record in log.lh from the log
+// blocks record_ok() left in rbuf[] to their home blocks in
+// the buffer cache, where they wait for install_pend() like
+// committed blocks. A block that several records replay is
+// written home once.
 static void
 install_trans(void)
 {
-  int tail;
+  int tail, r;
+  struct buf *lbuf;
 
+  r = 0;
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+    if (log.lh.ent[tail].type == LOG_PACK) {
+      lbuf = rbuf[r++];
+      log.inflight--;
+      install_pack(lbuf);
+      continue;
+    }
+    // The record replaces all of dst, so do not read it.
+    struct buf *dbuf = bgetnew(log.dev, log.lh.ent[tail].block);
+    if (log.lh.ent[tail].type == LOG_ZERO)
+      memset(dbuf->data, 0, BSIZE);
+    else {
+      lbuf = rbuf[r++];  // log block
+      log.inflight--;
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+      if (log.lh.ent[tail].type == LOG_ESCAPE)
+        *(uint*)dbuf->data = LOGMAGIC;
+    }
+    replayed(dbuf);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Checksum of the header fields that are in use.
+static uint
+headsum(struct logheader *lh)
+{
+  uint crc;
+
+  crc = crc32c(log.id, &lh->seq, sizeof(lh->seq) + sizeof(lh->n));
+  return crc32c(crc, lh->ent, lh->n*sizeof(lh->ent[0]));
+}
+
+// Copy header block b between disk image data and the
+// in-memory header lh; todisk says which way.
 static void
-read_head(void)
+headblock(struct logheader *lh, uchar *data, int b, int todisk)
 {
-  struct buf *buf = bread(log.dev, (log.start+1));
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  uint off, end, n;
+  uchar *p;
+
+  off = b*BSIZE;
+  end = HEADSIZE + lh->n*sizeof(struct logent);
+  if (end > off + BSIZE)
+    end = off + BSIZE;
+  for (; off < end; off += n, data += n) {
+    if (off < HEADSIZE) {
+      p = (uchar*)lh + off;
+      n = HEADSIZE - off;
+    } else {
+      p = (uchar*)lh->ent + (off - HEADSIZE);
+      n = end - off;
+    }
+    if (n > end - off)
+      n = end - off;
+    if (todisk)
+      memmove(data, p, n);
+    else
+      memmove(p, data, n);
   }
+}
+
+// Read the header of the record at ring position pos from disk
+// into the in-memory log header.
+// Return 0 if it is not a valid commit record.
+static int
+read_head(int pos)
+{
+  struct buf *buf;
+  int b, n;
+
+  buf = bread(log.ldev, RINGBLOCK(pos));
+  memmove(&log.lh, buf->data, HEADSIZE);
+  n = log.lh.n;
+  if (log.lh.magic != LOGMAGIC || n <= 0 || n > log.size) {
+    brelse(buf);
+    log.lh.n = 0;
+    return 0;
+  }
+  headblock(&log.lh, buf->data, 0, 0);
   brelse(buf);
+  for (b = 1; b < HEADBLOCKS(n); b++) {
+    buf = bread(log.ldev, RINGBLOCK(pos+b));
+    headblock(&log.lh, buf->data, b, 0);
+    brelse(buf);
+  }
+  if (log.lh.checksum != headsum(&log.lh)) {
+    log.lh.n = 0;
+    return 0;
+  }
+  return 1;
 }
 
-// Write in-memory log header to disk.
+// Write in-memory log header lh to disk at ring position pos.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *lh, int pos)
 {
-  struct buf *buf = bread(log.dev, (log.start+1));
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  struct buf *buf;
+  int b;
+
+  lh->magic = LOGMAGIC;
+  for (b = 0; b < HEADBLOCKS(lh->n); b++) {
+    buf = bgetnew(log.ldev, RINGBLOCK(pos+b));
+    memset(buf->data, 0, BSIZE);
+    headblock(lh, buf->data, b, 1);
+    bwrite(buf);
+    brelse(buf);
   }
+}
+
+// Record log.retired, log.tail and log.clean in the checkpoint block.
+static void
+write_ckpt(void)
+{
+  struct buf *buf = bgetnew(log.ldev, log.start);
+  struct logckpt ck;
+
+  ck.seq = log.retired;
+  ck.tail = log.tail;
+  ck.clean = log.clean;
+  ck.id = log.id;
+  memset(buf->data, 0, BSIZE);
+  memmove(buf->data, &ck, sizeof(ck));
   bwrite(buf);
   brelse(buf);
 }
 
+// Does every log block of the record at ring position pos,
+// whose header is in log.lh, match its CRC?
+// A log block that does not was torn, so its
+// transaction never committed. If they all match, they
+// stay locked in rbuf[] for install_trans().
+// All the reads are started before the first is waited
+// for, so that the disk driver can merge and sort them.
+static int
+record_ok(int pos)
+{
+  int i, n;
+
+  pos += HEADBLOCKS(log.lh.n);
+  n = recsize(&log.lh) - HEADBLOCKS(log.lh.n);
+  if (log.npend + n > log.pincap)
+    install_pend();  // make room to hold the record
+  for (i = 0; i < n; i++)
+    breadahead(log.ldev, RINGBLOCK(pos + i));
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.ent[i].type == LOG_ZERO)
+      continue;
+    rbuf[log.inflight] = bread(log.ldev, RINGBLOCK(pos + log.inflight));
+    if (crc32c(0, rbuf[log.inflight]->data, BSIZE) != log.lh.ent[i].crc) {
+      brelse(rbuf[log.inflight]);
+      while (log.inflight > 0)
+        brelse(rbuf[--log.inflight]);
+      return 0;
+    }
+    log.inflight++;
+  }
+  return 1;
+}
+
+// If the checkpoint block is clean, the file system was
+// fully installed and the ring is not scanned at all.
+// Otherwise replay the records after it into the buffer
+// cache in one pass, and install them once at the end.
 static void
 recover_from_log(void)
 {
-  uint disk_check, checksum;
-  int i, j;
-  checksum = 0;
-  struct buf *buf = bread(log.dev, log.start); // log block
-  disk_check = (buf->data[0]) + (buf->data[1]<<8) + (buf->data[2]<<16) + (buf->data[3]<<24); // read checksum block
-  
-  // calculate checksum from log header and log free blocks
-  for ( i = 0 ; i < log.lh.n ; i++ ) {
-    struct buf *logblocks = bread(log.dev, log.start+i+1+1); // log block
-    for ( j = 0; j < BSIZE ; j++ ) {
-	  checksum += ((j+1)*logblocks->data[j]);
-	}
-	brelse(logblocks);
-  }
+  struct buf *buf;
+  struct logckpt ck;
+  int pos;
+
+  buf = bread(log.ldev, log.start); // checkpoint block
+  memmove(&ck, buf->data, sizeof(ck));
   brelse(buf);
-  checksum %= BSIZE;
-  
-  
-  if (disk_check == checksum) {
-	cprintf("boot log checksum match, proceding with log commit. \n");
-    read_head();
-    install_trans(); // if committed, copy from log to disk
-    log.lh.n = 0;
-    write_head(); // clear the log
+  if (ck.id != log.id) {
+    // the log was never used by this file system,
+    // or holds a different file system's records.
+    memset(&ck, 0, sizeof(ck));
+    ck.tail = -1;
   }
-  else {
-    cprintf("boot log checksum mismatch, will not commit log.");
+  if (ck.tail < 0 || ck.tail >= log.ringsize) {
+    ck.tail = 0;
+    ck.clean = 0;  // make write_ckpt() initialize it
   }
-  
+  log.retired = ck.seq;
+  pos = ck.tail;
+
+  if (!ck.clean) {
+    while (read_head(pos) && log.lh.seq == log.retired+1 && record_ok(pos)) {
+      install_trans(); // if committed, copy from log to disk
+      log.retired = log.lh.seq;
+      pos = (pos + recsize(&log.lh)) % log.ringsize;
+    }
+    install_pend();
+  }
+  log.lh.n = 0;
+  log.head = log.tail = pos;
+  log.clean = 1;
+  if (!ck.clean)
+    write_ckpt();
+  log.done = log.retired;
+  log.tid = log.retired + 1;
+  log.idle = ticks;
+}
+
+// Would a transaction of n blocks fail to fit in the free
+// part of the ring, or pin too many blocks in the cache?
+// Caller must hold log.lock.
+static int
+logfull(int n)
+{
+  int used;
+
+  used = (log.head - log.tail + log.ringsize) % log.ringsize;
+  return used + HEADBLOCKS(n) + n >= log.ringsize ||
+    log.npend + log.inflight + n > log.pincap;
+}
+
+// Should the open transaction be committed now?
+// Caller must hold log.lock.
+static int
+commitdue(void)
+{
+  if(log.lh.n == 0)
+    return 0;
+  // commit once an op of MAXOPBLOCKS no longer fits
+  // next to the MAXOPBLOCKS begin_op() keeps back.
+  return log.force || ticks - log.opened >= LOGWINDOW ||
+    log.lh.n + 2*MAXOPBLOCKS > log.size || logfull(log.lh.n + 2*MAXOPBLOCKS);
+}
+
+// Should the committed transactions be installed now?
+// Caller must hold log.lock.
+static int
+ckptdue(void)
+{
+  int n;
+
+  if(log.npend == 0)
+    return 0;
+  if(!LOGLAZY)
+    return 1;
+  n = log.size/2;
+  if(n < MAXOPBLOCKS)
+    n = MAXOPBLOCKS;
+  return logfull(n) || ticks - log.idle >= LOGIDLE;
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call, which
+// can log up to nblocks blocks.
 void
-begin_op(void)
+begin_op(int nblocks)
 {
+  int n, slept;
+  uint t0;
+
+  // MAXOPBLOCKS of the log are kept back for ops that
+  // log more than they reserved.
+  if(nblocks > log.size - MAXOPBLOCKS)
+    panic("begin_op: too many blocks");
+  t0 = rdtsc();
+  slept = 0;
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    n = log.lh.n + log.reserved + nblocks + MAXOPBLOCKS;
+    if(log.committing || commitdue()){
+      // let the transaction drain so it can be committed.
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > (LOGSIZE-2)){
-      // this op might exhaust log space; wait for commit.
+      slept = 1;
+    } else if(n > log.size || logfull(n)){
+      // this op might exhaust log space; wait for commit
+      // and, if need be, a checkpoint.
+      wakeup(&log.committing);
       sleep(&log, &log.lock);
+      slept = 1;
     } else {
+      if(slept)
+        log.waited += rdtsc() - t0;
       log.outstanding += 1;
+      log.reserved += nblocks;
+      myproc()->logres = nblocks;
       release(&log.lock);
       break;
     }
@@ -177,65 +681,340 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// hands the transaction to the committer if this was
+// the last outstanding operation, but does not wait.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= myproc()->logres;
+  myproc()->logres = 0;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  if(log.outstanding == 0)
+    wakeup(&log.committing);
+  // begin_op() may be waiting for log space,
+  // and the rest of this op's reservation has
+  // been returned.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Wait until the updates of every FS system call that
+// has already called end_op() are on disk.
+void
+log_force(void)
+{
+  uint tid;
+
+  acquire(&log.lock);
+  // the open transaction, or else the one in commit().
+  tid = log.lh.n > 0 ? log.tid : log.tid - 1;
+  while((int)(log.done - tid) < 0){
+    if(log.lh.n > 0)
+      log.force = 1;
+    wakeup(&log.committing);
+    sleep(&log, &log.lock);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+// Install every committed block at its home location,
+// then record in the checkpoint block that the ring is empty.
+// Only called with no transaction open, so the cached
+// blocks hold exactly the committed contents.
+static void
+checkpoint(void)
+{
+  struct logstat ls;
+  uint t;
+
+  if (log.lh.n > 0)
+    panic("checkpoint");
+  memset(&ls, 0, sizeof(ls));
+  ls.seq = log.done;
+  ls.ninstall = log.npend;
+  t = rdtsc();
+  install_pend();
+  log.retired = log.done;
+  log.tail = log.head;
+  log.clean = 1;
+  write_ckpt();
+  ls.install = rdtsc() - t;
+
+  acquire(&log.lock);
+  logstat_add(&ls);
+  release(&log.lock);
+}
+
+// The committer kernel thread. Sleeps until the open
+// transaction is due and no FS system call is active,
+// then commits it, and checkpoints when the log is getting
+// full or the file system is idle.
+static void
+committer(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    if(log.outstanding > 0 || (log.lh.n == 0 && !ckptdue())){
+      if(log.outstanding == 0 && log.npend > 0)
+        sleep(&ticks, &log.lock);  // wait to become idle
+      else
+        sleep(&log.committing, &log.lock);
+      continue;
+    }
+    if(log.lh.n > 0 && !commitdue()){
+      // wait out the rest of the group commit window.
+      sleep(&ticks, &log.lock);
+      continue;
+    }
+    log.committing = 1;
+    log.force = 0;
+    release(&log.lock);
+
+    // call snapshot(), commit() and checkpoint() w/o holding
+    // locks, since not allowed to sleep with locks.
+    if(log.lh.n == 0){
+      checkpoint();
+      acquire(&log.lock);
+      log.committing = 0;
+      wakeup(&log);
+      continue;
+    }
+    snapshot();
+
+    // the next transaction may start now. Emptying log.lh
+    // and moving to the next tid together, under the lock,
+    // keeps log_force() from taking the transaction in
+    // log.ch for one already on disk.
     acquire(&log.lock);
+    log.inflight = recsize(&log.ch) - HEADBLOCKS(log.ch.n);
+    clear_index();
+    log.lh.n = 0;
+    log.tid++;
     log.committing = 0;
     wakeup(&log);
     release(&log.lock);
+
+    commit();
+
+    acquire(&log.lock);
+    logstat_add(&log.cs);
+    log.done = log.ch.seq;
+    log.inflight = 0;
+    log.idle = ticks;
+    wakeup(&log);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Empty the absorption index before the header is reset.
 static void
-write_log(void)
+clear_index(void)
+{
+  int i;
+
+  for (i = 0; i < log.lh.n; i++)
+    log.hhead[LOGHASHFN(log.lh.ent[i].block)] = 0;
+}
+
+// Bytes the deltas of a block take in a LOG_PACK block,
+// given the mask of its changed pieces.
+static int
+deltasize(uint mask)
+{
+  int i, n;
+
+  n = 0;
+  for (i = 0; i < 32; i++) {
+    if (mask & (1U << i)) {
+      if (i == 0 || (mask & (1U << (i-1))) == 0)
+        n += sizeof(struct logdelta);  // a run starts
+      n += DELTAGRAIN;
+    }
+  }
+  return n;
+}
+
+// Copy the changed pieces of b, one delta for each run of
+// them, to dst. Returns the bytes used, deltasize(mask).
+static int
+packdelta(uchar *dst, struct buf *b, uint mask)
+{
+  struct logdelta d;
+  int i, j, n;
+
+  n = 0;
+  for (i = 0; i < 32; i = j) {
+    if ((mask & (1U << i)) == 0) {
+      j = i + 1;
+      continue;
+    }
+    for (j = i; j < 32 && (mask & (1U << j)); j++)
+      ;
+    d.block = b->blockno;
+    d.off = i*DELTAGRAIN;
+    d.len = (j-i)*DELTAGRAIN;
+    memmove(dst + n, &d, sizeof(d));
+    memmove(dst + n + sizeof(d), b->data + d.off, d.len);
+    n += sizeof(d) + d.len;
+  }
+  return n;
+}
+
+// A LOG_PACK block is full: record its crc in e and
+// pin it until write_log().
+static void
+packdone(struct buf *pk, struct logent *e)
+{
+  e->crc = crc32c(0, pk->data, BSIZE);
+  pk->flags |= B_DIRTY;
+  brelse(pk);
+}
+
+// Copy modified blocks from cache to pinned buffers for
+// the record at log.head, and add them to the blocks waiting
+// for a checkpoint. The header is copied to log.ch; the
+// committer then empties log.lh, so that the open
+// transaction can start over in it.
+// The CRC of each block is computed here while it is
+// in hand, so the commit never has to re-read the log.
+static void
+snapshot(void)
 {
-  int tail;
+  int tail, pos, i, n, npack, pack, fill, ds;
+  struct logent *e;
+  struct buf *pk, *from, *to;
+  uint t;
+
+  memset(&log.cs, 0, sizeof(log.cs));
+  log.cs.seq = log.tid;
+  log.cs.nblocks = log.lh.n;
+  log.cs.nabsorb = log.nabsorb;
+  log.cs.waited = log.waited;
+  log.nabsorb = log.waited = 0;
+  t = rdtsc();
 
+  // Decide how each block is logged, and count the
+  // LOG_PACK blocks its deltas need. A block with
+  // too many changes to pack is logged whole.
+  npack = 0;
+  fill = PACKSPACE;
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    e = &log.lh.ent[tail];
+    if (e->type == LOG_DELTA) {
+      ds = deltasize(e->crc);
+      if (ds > PACKSPACE) {
+        e->type = LOG_DATA;
+      } else {
+        if (fill + ds > PACKSPACE) {
+          npack++;
+          fill = 0;
+        }
+        fill += ds;
+        log.cs.ndelta++;
+      }
+    }
+    if (e->type == LOG_ZERO)
+      log.cs.nzero++;
+  }
+
+  // The header lists the LOG_DATA and LOG_ZERO blocks,
+  // then the LOG_PACK blocks.
+  n = 0;
+  for (tail = 0; tail < log.lh.n; tail++)
+    if (log.lh.ent[tail].type != LOG_DELTA)
+      log.ch.ent[n++] = log.lh.ent[tail];
+  pack = n;
+  for (i = 0; i < npack; i++) {
+    log.ch.ent[n].block = 0;
+    log.ch.ent[n].type = LOG_PACK;
+    n++;
+  }
+  log.ch.n = n;
+  log.ch.seq = log.tid;
+
+  pos = log.head + HEADBLOCKS(log.ch.n);
+  for (i = 0; i < pack; i++) {
+    from = bread(log.dev, log.ch.ent[i].block); // cache block
+    if (log.ch.ent[i].type == LOG_DATA) {
+      to = bgetnew(log.ldev, RINGBLOCK(pos++)); // log block
+      memmove(to->data, from->data, BSIZE);
+      if (*(uint*)to->data == LOGMAGIC) {
+        *(uint*)to->data = 0;
+        log.ch.ent[i].type = LOG_ESCAPE;
+      }
+      log.ch.ent[i].crc = crc32c(0, to->data, BSIZE);
+      to->flags |= B_DIRTY;  // pin until write_log()
+      brelse(to);
+    }
+    addpend(from);
     brelse(from);
-    brelse(to);
   }
+
+  pk = 0;
+  fill = PACKSPACE;
+  for (tail = 0; tail < log.lh.n; tail++) {
+    e = &log.lh.ent[tail];
+    if (e->type != LOG_DELTA)
+      continue;
+    ds = deltasize(e->crc);
+    if (fill + ds > PACKSPACE) {
+      if (pk)
+        packdone(pk, &log.ch.ent[pack++]);
+      pk = bgetnew(log.ldev, RINGBLOCK(pos++)); // log block
+      memset(pk->data, 0, BSIZE);
+      fill = 0;
+    }
+    from = bread(log.dev, e->block); // cache block
+    fill += packdelta(pk->data + fill, from, e->crc);
+    addpend(from);
+    brelse(from);
+  }
+  if (pk)
+    packdone(pk, &log.ch.ent[pack++]);
+  log.ch.pos = log.head;
+  log.head = pos % log.ringsize;
+  log.cs.snapshot = rdtsc() - t;
+}
+
+// Write the snapshot taken by snapshot() to the log.
+static void
+write_log(void)
+{
+  int pos, end;
+
+  pos = log.ch.pos + HEADBLOCKS(log.ch.n);
+  end = log.ch.pos + recsize(&log.ch);
+  for (; pos < end; pos++) {
+    struct buf *to = bread(log.ldev, RINGBLOCK(pos)); // pinned log block
+    logsubmit(to);  // write the log; also unpins
+  }
+  logwait();
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_checksum(); // Calculate checksum
-	if (check_checksum()) {
-	  write_head();    // Write header to disk -- the real commit
-      install_trans(); // Now install writes to home locations
-      log.lh.n = 0;
-      write_head();    // Erase the transaction from the log
+  uint t;
+  int ok;
+
+  if (log.ch.n > 0) {
+    if (log.clean) {
+      log.clean = 0;
+      write_ckpt();  // A record follows the checkpoint now
+    }
+    t = rdtsc();
+    write_log();     // Write the snapshot to the log
+    log.cs.writelog = rdtsc() - t;
+    t = rdtsc();
+    write_checksum(); // Seal the header with its checksum
+    ok = check_checksum();
+    log.cs.checksum = rdtsc() - t;
+	if (ok) {
+	  t = rdtsc();
+	  write_head(&log.ch, log.ch.pos);    // Write header to disk -- the real commit
+	  log.cs.writehead = rdtsc() - t;
 	}
 	else {
 	  panic("log checksum has a missmatch");
@@ -243,6 +1022,54 @@ commit()
   }
 }
 
+// Record b in the open transaction as a block of the given
+// type, and pin it in the cache with B_DIRTY.
+static void
+log_add(struct buf *b, int type, uint mask)
+{
+  struct logent *e;
+  int i, h;
+
+  if (log.lh.n >= log.size)
+    panic("too big a transaction");
+  if (log.outstanding < 1)
+    panic("log_write outside of trans");
+
+  acquire(&log.lock);
+  h = LOGHASHFN(b->blockno);
+  for (i = log.hhead[h] - 1; i >= 0; i = log.hnext[i] - 1) {
+    if (log.lh.ent[i].block == b->blockno)   // log absorbtion
+      break;
+  }
+  if (i >= 0) {
+    log.nabsorb++;
+    e = &log.lh.ent[i];
+    if (type != LOG_DELTA) {
+      e->type = type;
+      e->crc = 0;
+    } else if (e->type == LOG_DELTA)
+      e->crc |= mask;
+    else if (e->type == LOG_ZERO)
+      e->type = LOG_DATA;   // no longer all zeros
+  } else {
+    if (log.lh.n == 0)
+      log.opened = ticks;   // start of the group commit window
+    if (myproc()->logres > 0) {
+      myproc()->logres--;
+      log.reserved--;
+    }
+    i = log.lh.n++;
+    log.lh.ent[i].block = b->blockno;
+    log.lh.ent[i].crc = type == LOG_DELTA ? mask : 0;
+    log.lh.ent[i].type = type;
+    log.hnext[i] = log.hhead[h];
+    log.hhead[h] = i + 1;
+  }
+
+  b->flags |= B_DIRTY; // prevent eviction
+  release(&log.lock);
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
 // commit()/write_log() will do the disk write.
@@ -255,94 +1082,68 @@ commit()
 void
 log_write(struct buf *b)
 {
-  int i;
+  log_add(b, LOG_DATA, 0);
+}
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= (log.size - 1 - 1))
-    panic("too big a transaction");
-  if (log.outstanding < 1)
-    panic("log_write outside of trans");
+// Like log_write(), for a block the caller has filled with
+// zeros. The record notes that the block is zero instead of
+// carrying a copy, unless it is changed again before commit.
+void
+log_zero(struct buf *b)
+{
+  log_add(b, LOG_ZERO, 0);
+}
 
-  acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
-      break;
-  }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
-  
-  b->flags |= B_DIRTY; // prevent eviction
-  release(&log.lock);
+// Like log_write(), when the caller has changed only the
+// n bytes at offset off of b->data.
+void
+log_write_range(struct buf *b, uint off, uint n)
+{
+  uint i, mask;
+
+  if (n == 0 || off + n > BSIZE)
+    panic("log_write_range");
+  mask = 0;
+  for (i = off/DELTAGRAIN; i <= (off+n-1)/DELTAGRAIN; i++)
+    mask |= 1U << i;
+  log_add(b, LOG_DELTA, mask);
 }
 
-// Reads through allocated log blocks to calculate the checksum
+// Computes the header checksum over the block #s and the crcs from write_log()
 void write_checksum() {
-  int i, j;
-  uint checksum = 0;
-  uint test_checksum1;
-  //uint test_checksum2;
-  
-  for ( i = 0 ; i < log.lh.n ; i++ ) {
-    struct buf *logblocks = bread(log.dev, log.start+i+1); // log block
-    for ( j = 0; j < BSIZE ; j++ ) {
-	  checksum += ((j+1)*logblocks->data[j]);
-	}
-	brelse(logblocks);
-  }
-  checksum %= BSIZE; //Minimize size due to issues with integer overflow
-  log.checksum = checksum;
-    
-  //cprintf("log %d , cal %d \n", log.checksum, checksum); 
-  cprintf("write_checksum() - log checksum calculated as: %x \n", log.checksum);  
-  
-  // write checksum into disk for crash and power failure protection
-  struct buf *check_block = bread(log.dev, log.start); // check block
-  
-  check_block->data[0] = (checksum); // write checksum into buffer
-  check_block->data[1] = (checksum>>8);
-  check_block->data[2] = (checksum>>16);
-  check_block->data[3] = (checksum>>24);
-  
-  bwrite(check_block); // write buffer to disk
-  brelse(check_block); // release buffer
-  
-  // TEST functionality of checksum on disk
-  struct buf *test_check = bread(log.dev, log.start);
-  test_checksum1 = (test_check->data[0]) + (test_check->data[1]<<8) + (test_check->data[2]<<16) + (test_check->data[3]<<24);
-  //test_checksum2 = test_check->data[BSIZE-1];
-  brelse(test_check);
-  
-  cprintf("disk written checksum data: %x \n" , test_checksum1);
-
-}
-
-// Reads through the allocated log blocks to calculate a new_checksum
+  log.ch.checksum = headsum(&log.ch);
+}
+
+// Recomputes a new_checksum over the header about to be written
 // Then compares the new one to the current one to verify log integrity
 int check_checksum() {
-  int i, j;
-  int check = 0;
-  uint new_checksum = 0;
-  
-  for ( i = 0 ; i < log.lh.n ; i++ ) {
-    struct buf *logblocks = bread(log.dev, log.start+i+1); // log block
-    for ( j = 0; j < BSIZE ; j++ ) {
-	  new_checksum += ((j+1)*logblocks->data[j]);
-	}
-	brelse(logblocks);
-  }
-  new_checksum %= BSIZE; // Minimize size due to issues integer overflow
-  // PRINT BOTH CHECKSUMS FOR VERIFICATION
-  cprintf("check_checksum() - log checksum: %x \n", log.checksum);
-  cprintf("check_checksum() - new checksum: %x \n", new_checksum);
-  
-  if (log.checksum == new_checksum) {
-	cprintf("check_checksum() - checksum validated prior to commit\n");
-	check = 1;
-  }
-  else {
-	cprintf("check_checksum() - ERROR: checksum invalid prior to commit\n");
-	check = 0;
+  return log.ch.checksum == headsum(&log.ch);
+}
+
+// Append a record to the statistics ring, dropping
+// the oldest unread one if it is full.
+// Caller must hold log.lock.
+static void
+logstat_add(struct logstat *ls)
+{
+  log.stat[log.statw++ % NLOGSTAT] = *ls;
+  if (log.statw - log.statr > NLOGSTAT)
+    log.statr = log.statw - NLOGSTAT;
+}
+
+// Read from the LOGSTAT device: as many whole unread
+// struct logstat records as fit, oldest first.
+static int
+logstatread(struct inode *ip, char *dst, uint off, int n)
+{
+  int r;
+
+  r = 0;
+  acquire(&log.lock);
+  while (log.statr != log.statw && n - r >= sizeof(struct logstat)) {
+    memmove(dst + r, &log.stat[log.statr++ % NLOGSTAT], sizeof(struct logstat));
+    r += sizeof(struct logstat);
   }
-  
-  return check;
+  release(&log.lock);
+  return r;
 }
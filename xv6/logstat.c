@@ -0,0 +1,34 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "logstat.h"
+
+// Print the commit statistics recorded since the last read
+// of the log statistics device. Times are printed in
+// thousands of cycles, which fit in a signed %d.
+
+struct logstat st[NLOGSTAT];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i, n;
+  struct logstat *s;
+
+  if((fd = open("/dev/logstat", 0)) < 0){
+    printf(2, "logstat: cannot open /dev/logstat\n");
+    exit();
+  }
+  printf(1, "seq blocks zero delta absorbed installed waited snapshot writelog checksum writehead install (kcycles)\n");
+  while((n = read(fd, st, sizeof(st))) > 0){
+    for(i = 0; i < n / sizeof(st[0]); i++){
+      s = &st[i];
+      printf(1, "%d %d %d %d %d %d %d %d %d %d %d %d\n", s->seq, s->nblocks,
+             s->nzero, s->ndelta, s->nabsorb, s->ninstall, s->waited/1000, s->snapshot/1000,
+             s->writelog/1000, s->checksum/1000, s->writehead/1000,
+             s->install/1000);
+    }
+  }
+  close(fd);
+  exit();
+}
@@ -0,0 +1,19 @@
+// Commit statistics, read from the log statistics device.
+// Times are in TSC cycles. The kernel keeps the statistics
+// of the last NLOGSTAT commits and checkpoints.
+#define NLOGSTAT 16
+
+struct logstat {
+  uint seq;       // Transaction
+  uint nblocks;   // Blocks logged
+  uint nzero;     // Of them, zero blocks logged without a copy
+  uint ndelta;    // Of them, blocks logged as deltas
+  uint nabsorb;   // log_write()s absorbed into a logged block
+  uint ninstall;  // Blocks installed by the checkpoint after it, if any
+  uint waited;    // Time begin_op() callers slept while it was open
+  uint snapshot;  // Time copying blocks to log buffers
+  uint writelog;  // Time in write_log()
+  uint checksum;  // Time computing and checking the header checksum
+  uint writehead; // Time in write_head()
+  uint install;   // Time in the checkpoint after it, if any
+};
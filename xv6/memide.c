@@ -32,22 +32,24 @@ ideintr(void)
   // no-op
 }
 
-// Sync buf with disk.
+// Sync buf with disk, at once: the memory disk never makes
+// anyone wait.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// If buf->done is set, call it when done.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
   uchar *p;
 
   if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
+    panic("idesubmit: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+    panic("idesubmit: nothing to do");
   if(b->dev != 1)
-    panic("iderw: request not for disk 1");
+    panic("idesubmit: request not for disk 1");
   if(b->blockno >= disksize)
-    panic("iderw: block out of range");
+    panic("idesubmit: block out of range");
 
   p = memdisk + b->blockno*BSIZE;
 
@@ -57,4 +59,20 @@ iderw(struct buf *b)
   } else
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
+  if(b->done)
+    bcomplete(b);
+}
+
+// Wait for the request idesubmit() started for buf,
+// which has already finished.
+void
+ideawait(struct buf *b)
+{
+}
+
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  ideawait(b);
 }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>
 
 #define stat xv6_stat  // avoid clash with host struct stat
 #include "types.h"
@@ -23,6 +24,8 @@
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
 int nlog = LOGSIZE;
+int nfslog;  // Number of log blocks in the file system image
+int jstart;  // Log start on the boot disk (mkfs -j), or 0
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -70,14 +73,35 @@ main(int argc, char *argv[])
   int i, cc, fd;
   uint rootino, inum, off;
   struct dirent de;
+  struct logckpt ck;
   char buf[BSIZE];
   struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-l") == 0)
+      nlog = atoi(argv[2]);
+    else if(strcmp(argv[1], "-j") == 0)
+      jstart = atoi(argv[2]);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] [-j logstart] fs.img files...\n");
+    exit(1);
+  }
+  nfslog = jstart ? 0 : nlog;
+  if(nlog < 3 || 2 + nfslog + ninodeblocks + nbitmap >= FSSIZE){
+    fprintf(stderr, "mkfs: bad log size %d\n", nlog);
+    exit(1);
+  }
+  if(jstart && (jstart < 2 || jstart + nlog > BOOTSIZE)){
+    fprintf(stderr, "mkfs: bad log start %d\n", jstart);
     exit(1);
   }
 
@@ -91,19 +115,21 @@ main(int argc, char *argv[])
   }
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  nmeta = 2 + nfslog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
 
   sb.size = xint(FSSIZE);
   sb.nblocks = xint(nblocks);
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.logstart = xint(jstart ? jstart : 2);
+  sb.inodestart = xint(2+nfslog);
+  sb.bmapstart = xint(2+nfslog+ninodeblocks);
+  sb.logdev = xint(jstart ? 0 : ROOTDEV);
+  sb.logid = xint(time(0));
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nfslog, ninodeblocks, nbitmap, nblocks, FSSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -114,6 +140,16 @@ main(int argc, char *argv[])
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
 
+  // a log on the boot disk is initialized at first boot.
+  if(!jstart){
+    memset(&ck, 0, sizeof(ck));
+    ck.clean = xint(1);
+    ck.id = sb.logid;
+    memset(buf, 0, sizeof(buf));
+    memmove(buf, &ck, sizeof(ck));
+    wsect(sb.logstart, buf);
+  }
+
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
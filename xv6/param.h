@@ -8,7 +8,14 @@
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      200  // default blocks in on-disk log (mkfs -l)
+#define NBUF         200  // disk block cache buffers allocated at boot
+#define BCACHEFRAC   8  // cache may grow to 1/BCACHEFRAC of memory
+#define BCACHE2Q     1  // 2Q cache replacement; 0 for plain LRU
+#define READAHEAD    16  // max blocks read ahead of sequential reads
+#define FSSIZE       2000  // size of file system in blocks
+#define BOOTSIZE     10000  // size of boot disk in blocks
+#define LOGWINDOW    2  // group commit window (ticks)
+#define LOGLAZY      1  // defer installing committed blocks
+#define LOGIDLE      50  // idle ticks before a lazy checkpoint
 
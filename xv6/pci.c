@@ -0,0 +1,45 @@
+// PCI configuration space access through I/O ports
+// 0xCF8 and 0xCFC (configuration mechanism #1).
+// A function is named by a tag: bus<<16 | dev<<11 | fn<<8.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+
+#define PCI_CONFADDR  0xCF8
+#define PCI_CONFDATA  0xCFC
+#define PCI_ENABLE    0x80000000
+
+uint
+pciread(int tag, int reg)
+{
+  outl(PCI_CONFADDR, PCI_ENABLE | tag | (reg & 0xfc));
+  return inl(PCI_CONFDATA);
+}
+
+void
+pciwrite(int tag, int reg, uint v)
+{
+  outl(PCI_CONFADDR, PCI_ENABLE | tag | (reg & 0xfc));
+  outl(PCI_CONFDATA, v);
+}
+
+// Return the tag of the first function on bus 0 whose
+// configuration register reg, masked with mask, equals val,
+// or -1 if there is none. Bus 0 is all QEMU's PC has.
+int
+pcifind(int reg, uint val, uint mask)
+{
+  int dev, fn, tag;
+
+  for(dev = 0; dev < 32; dev++){
+    for(fn = 0; fn < 8; fn++){
+      tag = dev<<11 | fn<<8;
+      if((pciread(tag, 0) & 0xffff) == 0xffff)
+        continue;  // no such function
+      if((pciread(tag, reg) & mask) == val)
+        return tag;
+    }
+  }
+  return -1;
+}
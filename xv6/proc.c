@@ -153,6 +153,35 @@ userinit(void)
   release(&ptable.lock);
 }
 
+// Start a kernel thread running fn(), which must never return.
+// The thread has no user memory and never enters user space.
+int
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  if((p->pgdir = setupkvm()) == 0){
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return -1;
+  }
+  // Make forkret return to fn instead of trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+  p->parent = initproc;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+
+  p->state = RUNNABLE;
+
+  release(&ptable.lock);
+
+  return p->pid;
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -242,7 +271,7 @@ exit(void)
     }
   }
 
-  begin_op();
+  begin_op(iputblocks());
   iput(curproc->cwd);
   end_op();
   curproc->cwd = 0;
@@ -48,6 +48,7 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  int logres;                  // Unused log reservation of the FS op
   char name[16];               // Process name (debugging)
 };
 
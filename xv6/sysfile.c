@@ -114,6 +114,33 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Wait until all completed file system updates,
+// including those to f, are on disk.
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_force();
+  return 0;
+}
+
+// Log blocks the ops below reserve with begin_op().
+// A directory entry never spans two blocks, so writing one
+// can log as much as a one-byte writei(). Each path lookup
+// can drop the last reference to a directory removed
+// meanwhile, so ops reserve iputblocks() for it, and again
+// for each inode they look up and then put.
+// CREATEBLOCKS is what create() itself logs: an entry in
+// the new directory and one in its parent, its lookup, and
+// the put of the parent (or of an existing inode it turns
+// down). Its callers may put the inode it returns, so they
+// reserve CREATEBLOCKS + iputblocks().
+#define DIRENTBLOCKS writeiblocks(1)
+#define CREATEBLOCKS (2*DIRENTBLOCKS + 2*iputblocks())
+
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)
@@ -124,7 +151,7 @@ sys_link(void)
   if(argstr(0, &old) < 0 || argstr(1, &new) < 0)
     return -1;
 
-  begin_op();
+  begin_op(1 + DIRENTBLOCKS + 2*iputblocks());
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -192,7 +219,7 @@ sys_unlink(void)
   if(argstr(0, &path) < 0)
     return -1;
 
-  begin_op();
+  begin_op(DIRENTBLOCKS + 2*iputblocks());
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -293,7 +320,10 @@ sys_open(void)
   if(argstr(0, &path) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op();
+  if(omode & O_CREATE)
+    begin_op(CREATEBLOCKS + iputblocks());
+  else
+    begin_op(2*iputblocks());
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -338,7 +368,7 @@ sys_mkdir(void)
   char *path;
   struct inode *ip;
 
-  begin_op();
+  begin_op(CREATEBLOCKS + iputblocks());
   if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -355,7 +385,7 @@ sys_mknod(void)
   char *path;
   int major, minor;
 
-  begin_op();
+  begin_op(CREATEBLOCKS + iputblocks());
   if((argstr(0, &path)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
@@ -375,7 +405,7 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *curproc = myproc();
   
-  begin_op();
+  begin_op(2*iputblocks());
   if(argstr(0, &path) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
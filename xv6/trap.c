@@ -80,6 +80,10 @@ trap(struct trapframe *tf)
 
   //PAGEBREAK: 13
   default:
+    if(tf->trapno >= T_IRQ0 && virtiointr(tf->trapno - T_IRQ0)){
+      lapiceoi();
+      break;
+    }
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
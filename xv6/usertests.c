@@ -7,6 +7,8 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "logstat.h"
+#include "bcstat.h"
 
 char buf[8192];
 char name[3];
@@ -135,6 +137,233 @@ opentest(void)
   printf(stdout, "open test ok\n");
 }
 
+// Read all new records from /dev/logstat and return the
+// newest seq among them, or last if none is newer.
+uint
+logseq(uint last)
+{
+  struct logstat st[NLOGSTAT];
+  int fd, i, n;
+
+  fd = open("/dev/logstat", O_RDONLY);
+  if(fd < 0){
+    printf(stdout, "open /dev/logstat failed\n");
+    exit();
+  }
+  while((n = read(fd, st, sizeof(st))) > 0)
+    for(i = 0; i < n / sizeof(st[0]); i++)
+      if(st[i].seq > last)
+        last = st[i].seq;
+  close(fd);
+  return last;
+}
+
+// fsync must wait for the log and reject bad descriptors
+void
+fsynctest(void)
+{
+  int fd;
+  uint seq;
+
+  printf(stdout, "fsync test\n");
+  fd = open("fsyncfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "open fsyncfile failed\n");
+    exit();
+  }
+  // Everything so far is on disk, so the write below
+  // goes in a transaction after seq.
+  if(fsync(fd) != 0){
+    printf(stdout, "fsync failed\n");
+    exit();
+  }
+  seq = logseq(0);
+  if(write(fd, "aaaaaaaaaa", 10) != 10){
+    printf(stdout, "write fsyncfile failed\n");
+    exit();
+  }
+  if(fsync(fd) != 0){
+    printf(stdout, "fsync failed\n");
+    exit();
+  }
+  if(logseq(seq) == seq){
+    printf(stdout, "fsync returned before the write was committed\n");
+    exit();
+  }
+  close(fd);
+  if(fsync(fd) >= 0){
+    printf(stdout, "fsync of closed fd succeeded!\n");
+    exit();
+  }
+  if(unlink("fsyncfile") < 0){
+    printf(stdout, "unlink fsyncfile failed\n");
+    exit();
+  }
+  printf(stdout, "fsync test ok\n");
+}
+
+// after a forced commit, /dev/logstat holds whole records,
+// the last of which has logged blocks.
+void
+logstattest(void)
+{
+  struct logstat st[NLOGSTAT];
+  int fd, n, last;
+
+  printf(stdout, "logstat test\n");
+  fd = open("lsfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, "x", 1) != 1 || fsync(fd) != 0){
+    printf(stdout, "logstat: lsfile failed\n");
+    exit();
+  }
+  close(fd);
+  unlink("lsfile");
+  fd = open("/dev/logstat", O_RDONLY);
+  if(fd < 0){
+    printf(stdout, "open /dev/logstat failed\n");
+    exit();
+  }
+  last = -1;
+  while((n = read(fd, st, sizeof(st))) > 0){
+    if(n % sizeof(st[0]) != 0){
+      printf(stdout, "logstat: partial record\n");
+      exit();
+    }
+    last = n / sizeof(st[0]) - 1;
+    if(st[last].nblocks == 0 && last > 0)
+      last--;  // a checkpoint followed the commit
+  }
+  if(last < 0 || st[last].nblocks == 0){
+    printf(stdout, "logstat: no commit recorded\n");
+    exit();
+  }
+  close(fd);
+  printf(stdout, "logstat test ok\n");
+}
+
+// Write n bytes of c to fd.
+void
+wfill(int fd, int c, int n)
+{
+  memset(buf, c, n);
+  if(write(fd, buf, n) != n){
+    printf(stdout, "delta: write failed\n");
+    exit();
+  }
+}
+
+// Partial and whole-block writes to the same blocks in one
+// transaction: some blocks are logged as deltas, some change
+// too much to pack and are logged whole, and some are logged
+// whole after deltas. All must read back as written.
+void
+deltatest(void)
+{
+  struct { int off, n, c; } want[] = {
+    { 0, BSIZE, 'h' },
+    { BSIZE, 10, 'i' },
+    { BSIZE+10, 10, 'd' },
+    { BSIZE+20, BSIZE-20, 'e' },
+    { 2*BSIZE, BSIZE, 'f' },
+    { 3*BSIZE, 5, 'g' },
+  };
+  int fd, fd2, i, j;
+
+  printf(stdout, "delta test\n");
+  fd = open("deltafile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "open deltafile failed\n");
+    exit();
+  }
+  for(i = 0; i < 3; i++)
+    wfill(fd, 'a', BSIZE);
+  close(fd);
+
+  // Start a new transaction, then write quickly so that
+  // the writes below are likely committed together.
+  fd = open("deltafile", O_RDWR);
+  fd2 = open("deltafile", O_RDWR);
+  if(fd < 0 || fd2 < 0 || fsync(fd) != 0){
+    printf(stdout, "reopen deltafile failed\n");
+    exit();
+  }
+  wfill(fd, 'b', 10);          // small deltas in block 0
+  wfill(fd, 'c', BSIZE-30);    // most of block 0: logged whole
+  wfill(fd, 'd', 40);          // deltas in blocks 0 and 1
+  wfill(fd, 'e', BSIZE-20);    // the rest of block 1
+  wfill(fd2, 'h', BSIZE);      // block 0 again, whole
+  wfill(fd2, 'i', 10);         // a delta on top of block 1
+  wfill(fd, 'f', BSIZE);       // block 2, whole
+  wfill(fd, 'g', 5);           // a new block, partly
+  if(fsync(fd) != 0){
+    printf(stdout, "delta: fsync failed\n");
+    exit();
+  }
+  close(fd);
+  close(fd2);
+
+  fd = open("deltafile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 3*BSIZE+5){
+    printf(stdout, "delta: read back failed\n");
+    exit();
+  }
+  close(fd);
+  for(i = 0; i < sizeof(want)/sizeof(want[0]); i++){
+    for(j = want[i].off; j < want[i].off + want[i].n; j++){
+      if(buf[j] != want[i].c){
+        printf(stdout, "delta: byte %d is %c, not %c\n", j, buf[j], want[i].c);
+        exit();
+      }
+    }
+  }
+  if(unlink("deltafile") < 0){
+    printf(stdout, "unlink deltafile failed\n");
+    exit();
+  }
+  printf(stdout, "delta test ok\n");
+}
+
+// The buffer cache counts a hit for a block just read.
+void
+bcstattest(void)
+{
+  struct bcstat st[NCPU];
+  struct stat s;
+  uint hit[2];
+  int fd, i, n, k;
+
+  printf(stdout, "bcstat test\n");
+  for(k = 0; k < 2; k++){
+    if(stat(".", &s) < 0){
+      printf(stdout, "bcstat: stat . failed\n");
+      exit();
+    }
+    fd = open("/dev/bcstat", O_RDONLY);
+    if(fd < 0){
+      printf(stdout, "open /dev/bcstat failed\n");
+      exit();
+    }
+    n = read(fd, st, sizeof(st));
+    if(n <= 0 || n % sizeof(st[0]) != 0){
+      printf(stdout, "bcstat: bad read %d\n", n);
+      exit();
+    }
+    if(read(fd, st, sizeof(st)) != 0){
+      printf(stdout, "bcstat: no end of file\n");
+      exit();
+    }
+    close(fd);
+    hit[k] = 0;
+    for(i = 0; i < n / sizeof(st[0]); i++)
+      hit[k] += st[i].hit;
+  }
+  if(hit[1] == hit[0]){
+    printf(stdout, "bcstat: no hits counted\n");
+    exit();
+  }
+  printf(stdout, "bcstat test ok\n");
+}
+
 void
 writetest(void)
 {
@@ -1771,6 +2000,10 @@ main(int argc, char *argv[])
   validatetest();
 
   opentest();
+  fsynctest();
+  logstattest();
+  bcstattest();
+  deltatest();
   writetest();
   writetest1();
   createtest();
@@ -0,0 +1,322 @@
+// Driver for a virtio-blk disk on PCI, using the legacy
+// (virtio 0.9.5) register interface that QEMU provides.
+// It serves disk 1, the file system, in place of the IDE
+// disk when "make VIRTIO=1" attaches fs.img that way;
+// idesubmit() hands it the requests.
+//
+// Unlike the IDE disk, it can have many requests in flight:
+// each buf is a chain of three descriptors (request header,
+// data, status byte) on one virtqueue, and virtiointr()
+// completes every finished request per interrupt.
+//
+// If the disk offers VIRTIO_RING_F_EVENT_IDX, interrupts are
+// coalesced: the driver asks for one only once VIRTIO_BATCH
+// requests, or all those in flight, have finished. In the
+// same way, the disk says when it needs a notify.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+// Legacy virtio PCI registers, from BAR0.
+#define VIRTIO_FEATURES   0x00  // device features
+#define VIRTIO_GFEATURES  0x04  // features the driver accepts
+#define VIRTIO_QPFN       0x08  // page number of the selected queue
+#define VIRTIO_QNUM       0x0c  // size of the selected queue
+#define VIRTIO_QSEL       0x0e  // queue select
+#define VIRTIO_QNOTIFY    0x10  // queue notify
+#define VIRTIO_STATUS     0x12  // device status
+#define VIRTIO_ISR        0x13  // interrupt status; reading clears
+
+#define VIRTIO_ACK        1     // status: driver found the device
+#define VIRTIO_DRIVER     2     // status: driver knows how to drive it
+#define VIRTIO_DRIVER_OK  4     // status: driver is ready
+
+#define VIRTIO_F_EVENT_IDX (1<<29)  // used_event and avail_event
+
+#define VRING_NEXT        1     // descriptor continues via next
+#define VRING_WRITE       2     // device writes the buffer
+#define VRING_ALIGN       PGSIZE
+
+#define VIRTIO_BLK_IN     0     // read request
+#define VIRTIO_BLK_OUT    1     // write request
+
+#define NVDESC            256   // largest queue we can host
+#define VIRTIO_BATCH      8     // completions per interrupt, at most
+
+struct vdesc {
+  uint addr;
+  uint addrhi;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+
+struct vavail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vusedelem {
+  uint id;
+  uint len;
+};
+
+struct vused {
+  ushort flags;
+  ushort idx;
+  struct vusedelem ring[];
+};
+
+struct vblkreq {
+  uint type;
+  uint reserved;
+  uint sector[2];  // 64-bit sector number, low word first
+};
+
+// The queue's pages must be physically contiguous, so they
+// live in the kernel's own data rather than in kalloc() pages.
+static char vqmem[3*PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static struct {
+  struct spinlock lock;
+  ushort io;     // register base, or 0 if there is no disk
+  int irq;
+  int num;       // queue size
+  struct vdesc *desc;
+  struct vavail *avail;
+  struct vused *used;
+  ushort usedidx;  // next used entry to look at
+  int eventidx;    // VIRTIO_F_EVENT_IDX was negotiated
+  ushort *usedevent;   // after avail ring: interrupt past this
+  ushort *availevent;  // after used ring: notify past this
+  char free[NVDESC];  // is descriptor free?
+  int nfree;
+  struct buf *info[NVDESC];  // buf of the chain each head starts
+  struct vblkreq req[NVDESC];
+  uchar status[NVDESC];
+} vdisk;
+
+// Find and set up the disk. Returns 1 if there is one.
+int
+virtioinit(void)
+{
+  int tag, i;
+  uint bar;
+  char *used;
+
+  // Legacy virtio-blk: vendor 0x1af4, device 0x1001.
+  if((tag = pcifind(0x00, 0x10011af4, 0xffffffff)) < 0)
+    return 0;
+  if(((bar = pciread(tag, 0x10)) & 1) == 0)
+    return 0;
+  pciwrite(tag, 0x04, pciread(tag, 0x04) | 0x5);  // I/O, bus master
+
+  initlock(&vdisk.lock, "virtio");
+  vdisk.io = bar & 0xfffc;
+  outb(vdisk.io+VIRTIO_STATUS, 0);  // reset
+  outb(vdisk.io+VIRTIO_STATUS, VIRTIO_ACK);
+  outb(vdisk.io+VIRTIO_STATUS, VIRTIO_ACK|VIRTIO_DRIVER);
+  vdisk.eventidx = (inl(vdisk.io+VIRTIO_FEATURES) & VIRTIO_F_EVENT_IDX) != 0;
+  outl(vdisk.io+VIRTIO_GFEATURES, vdisk.eventidx ? VIRTIO_F_EVENT_IDX : 0);
+
+  outw(vdisk.io+VIRTIO_QSEL, 0);
+  vdisk.num = inw(vdisk.io+VIRTIO_QNUM);
+  if(vdisk.num == 0 || vdisk.num > NVDESC)
+    panic("virtioinit: queue size");
+  vdisk.desc = (struct vdesc*)vqmem;
+  vdisk.avail = (struct vavail*)(vqmem + vdisk.num*sizeof(struct vdesc));
+  used = (char*)&vdisk.avail->ring[vdisk.num+1];
+  vdisk.used = (struct vused*)PGROUNDUP((uint)used);
+  vdisk.usedevent = &vdisk.avail->ring[vdisk.num];
+  vdisk.availevent = (ushort*)&vdisk.used->ring[vdisk.num];
+  for(i = 0; i < vdisk.num; i++)
+    vdisk.free[i] = 1;
+  vdisk.nfree = vdisk.num;
+  outl(vdisk.io+VIRTIO_QPFN, V2P(vqmem) / VRING_ALIGN);
+
+  vdisk.irq = pciread(tag, 0x3c) & 0xff;
+  ioapicenable(vdisk.irq, ncpu - 1);
+  outb(vdisk.io+VIRTIO_STATUS, VIRTIO_ACK|VIRTIO_DRIVER|VIRTIO_DRIVER_OK);
+  return 1;
+}
+
+static int
+allocdesc(void)
+{
+  int i;
+
+  for(i = 0; i < vdisk.num; i++){
+    if(vdisk.free[i]){
+      vdisk.free[i] = 0;
+      vdisk.nfree--;
+      return i;
+    }
+  }
+  panic("virtio: no descriptors");
+}
+
+// Free the chain of descriptors starting at i.
+static void
+freechain(int i)
+{
+  for(;;){
+    vdisk.free[i] = 1;
+    vdisk.nfree++;
+    if((vdisk.desc[i].flags & VRING_NEXT) == 0)
+      break;
+    i = vdisk.desc[i].next;
+  }
+  wakeup(&vdisk.free);
+}
+
+static void
+setdesc(int i, void *va, uint len, int flags, int next)
+{
+  vdisk.desc[i].addr = V2P(va);
+  vdisk.desc[i].addrhi = 0;
+  vdisk.desc[i].len = len;
+  vdisk.desc[i].flags = flags;
+  vdisk.desc[i].next = next;
+}
+
+// Would the other side, having asked to hear once the index
+// passes event, want to hear that it moved from old to new?
+static int
+needevent(ushort event, ushort new, ushort old)
+{
+  return (ushort)(new - event - 1) < (ushort)(new - old);
+}
+
+// Ask for an interrupt once VIRTIO_BATCH more requests,
+// or all those in flight, have finished. The caller holds
+// vdisk.lock.
+static void
+setusedevent(void)
+{
+  ushort n;
+
+  n = vdisk.avail->idx - vdisk.usedidx;
+  if(n > VIRTIO_BATCH)
+    n = VIRTIO_BATCH;
+  *vdisk.usedevent = vdisk.usedidx + n - 1;
+  __sync_synchronize();
+}
+
+// Queue b for the disk without waiting, like idesubmit().
+void
+virtiosubmit(struct buf *b)
+{
+  int d0, d1, d2;
+  uint sector;
+  ushort old;
+  struct vblkreq *r;
+
+  if(b->blockno >= FSSIZE)
+    panic("virtiosubmit: incorrect blockno");
+
+  acquire(&vdisk.lock);
+  while(vdisk.nfree < 3)
+    sleep(&vdisk.free, &vdisk.lock);
+  d0 = allocdesc();
+  d1 = allocdesc();
+  d2 = allocdesc();
+
+  sector = b->blockno * (BSIZE/512);
+  r = &vdisk.req[d0];
+  r->type = (b->flags & B_DIRTY) ? VIRTIO_BLK_OUT : VIRTIO_BLK_IN;
+  r->reserved = 0;
+  r->sector[0] = sector;
+  r->sector[1] = 0;
+  vdisk.status[d0] = 0xff;
+  vdisk.info[d0] = b;
+  setdesc(d0, r, sizeof(*r), VRING_NEXT, d1);
+  setdesc(d1, b->data, BSIZE,
+          VRING_NEXT | ((b->flags & B_DIRTY) ? 0 : VRING_WRITE), d2);
+  setdesc(d2, &vdisk.status[d0], 1, VRING_WRITE, 0);
+
+  // Publish the chain, then the new index, then tell the
+  // disk, unless it is still working through earlier ones.
+  old = vdisk.avail->idx;
+  vdisk.avail->ring[old % vdisk.num] = d0;
+  __sync_synchronize();
+  vdisk.avail->idx = old + 1;
+  __sync_synchronize();
+  if(vdisk.eventidx)
+    setusedevent();
+  if(!vdisk.eventidx || needevent(*vdisk.availevent, old + 1, old))
+    outw(vdisk.io+VIRTIO_QNOTIFY, 0);
+  release(&vdisk.lock);
+}
+
+// Wait for the request virtiosubmit() started for b,
+// which has no done function, to finish.
+void
+virtioawait(struct buf *b)
+{
+  acquire(&vdisk.lock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
+    sleep(b, &vdisk.lock);
+  }
+  release(&vdisk.lock);
+}
+
+// Interrupt handler. Returns 0 if irq is not the disk's.
+int
+virtiointr(int irq)
+{
+  struct buf *b, *done, *next;
+  int id;
+
+  if(vdisk.io == 0 || irq != vdisk.irq)
+    return 0;
+
+  acquire(&vdisk.lock);
+  // Reading ISR lowers the interrupt line; requests
+  // finishing after this raise it again.
+  inb(vdisk.io+VIRTIO_ISR);
+  __sync_synchronize();
+
+  done = 0;
+again:
+  while(vdisk.usedidx != vdisk.used->idx){
+    id = vdisk.used->ring[vdisk.usedidx % vdisk.num].id;
+    vdisk.usedidx++;
+    if(vdisk.status[id] != 0)
+      panic("virtiointr: status");
+    b = vdisk.info[id];
+    vdisk.info[id] = 0;
+    freechain(id);
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->done){
+      b->qnext = done;
+      done = b;
+    } else
+      wakeup(b);
+  }
+  if(vdisk.eventidx){
+    // Requests that finished before the new used_event was
+    // seen do not interrupt, so look once more.
+    setusedevent();
+    if(vdisk.usedidx != vdisk.used->idx)
+      goto again;
+  }
+  release(&vdisk.lock);
+
+  // Hand bufs with a done function over to it.
+  for(; done; done = next){
+    next = done->qnext;
+    bcomplete(done);
+  }
+  return 1;
+}